@@ -3,6 +3,15 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <typeinfo>
 #include <vector>
 #include <unordered_map>
 #include <utility>
@@ -10,6 +19,7 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 #include "RootExt.h"
 #include "TextIO.h"
 #include "SmartHistogram.h"
+#include "ThreadUidTable.h"
 
 #define ANA_DATA_ENTRY(type, name, ...) \
     root_ext::AnalyzerDataEntry<type> name{#name, this, ##__VA_ARGS__};
@@ -51,19 +61,94 @@ struct AnalyzerDataEntryBase {
     using Mutex = std::recursive_mutex;
 
     AnalyzerDataEntryBase(const std::string& _name, AnalyzerData* _data);
-    virtual ~AnalyzerDataEntryBase() {}
+    virtual ~AnalyzerDataEntryBase();
     const std::string& Name() const;
     Mutex& GetMutex();
+    virtual void MergeShards() {}
 private:
     std::string name;
     Mutex mutex;
 protected:
     AnalyzerData* data;
+    const size_t uid; // unique for the lifetime of the process, used as a key for the thread-local lookups
 };
 
 template<typename _ValueType>
 struct AnalyzerDataEntry;
 
+namespace detail {
+
+// Suffix that consists only of integral and enum values, identified without converting it into a string.
+struct TypedSuffixKey {
+    static constexpr size_t MaxSize = 4;
+
+    const std::type_info* type{nullptr}; // type of the suffix tuple
+    std::array<long long, MaxSize> values{};
+
+    bool operator==(const TypedSuffixKey& other) const { return type == other.type && values == other.values; }
+};
+
+struct TypedSuffixKeyHash {
+    size_t operator()(const TypedSuffixKey& key) const
+    {
+        size_t hash = std::hash<const void*>()(key.type);
+        for(long long value : key.values)
+            hash = hash * 31 + std::hash<long long>()(value);
+        return hash;
+    }
+};
+
+template<typename T>
+using IsTypedSuffixValue = std::integral_constant<bool, std::is_integral<std::decay_t<T>>::value
+                                                        || std::is_enum<std::decay_t<T>>::value>;
+
+template<typename... KeySuffix>
+struct IsTypedSuffixTuple : std::true_type {};
+
+template<typename T, typename... KeySuffix>
+struct IsTypedSuffixTuple<T, KeySuffix...> :
+    std::integral_constant<bool, IsTypedSuffixValue<T>::value && IsTypedSuffixTuple<KeySuffix...>::value> {};
+
+template<typename... KeySuffix>
+using IsTypedSuffix = std::integral_constant<bool, sizeof...(KeySuffix) != 0
+                                                   && sizeof...(KeySuffix) <= TypedSuffixKey::MaxSize
+                                                   && IsTypedSuffixTuple<KeySuffix...>::value>;
+
+template<typename... KeySuffix>
+TypedSuffixKey MakeTypedSuffixKey(const KeySuffix&... suffix)
+{
+    TypedSuffixKey key;
+    key.type = &typeid(std::tuple<std::decay_t<KeySuffix>...>);
+    const std::array<long long, sizeof...(KeySuffix)> values = {{ static_cast<long long>(suffix)... }};
+    std::copy(values.begin(), values.end(), key.values.begin());
+    return key;
+}
+
+template<typename T>
+using IsPrintedAsNumber = std::integral_constant<bool, std::is_integral<T>::value && !std::is_same<T, bool>::value
+        && !std::is_same<T, char>::value && !std::is_same<T, signed char>::value
+        && !std::is_same<T, unsigned char>::value && !std::is_same<T, wchar_t>::value
+        && !std::is_same<T, char16_t>::value && !std::is_same<T, char32_t>::value>;
+
+template<typename T>
+std::string SuffixToString(const T& value, std::true_type /*is_printed_as_number*/) { return std::to_string(value); }
+
+template<typename T>
+std::string SuffixToString(const T& value, std::false_type /*is_printed_as_number*/)
+{
+    std::ostringstream ss;
+    ss << value;
+    return ss.str();
+}
+
+// Same result as printing the value into a stream, without creating a stream for strings and numbers.
+template<typename T>
+std::string SuffixToString(const T& value) { return SuffixToString(value, IsPrintedAsNumber<T>()); }
+inline std::string SuffixToString(const std::string& value) { return value; }
+inline std::string SuffixToString(const char* value) { return value; }
+
+} // namespace detail
+
 class AnalyzerData {
 public:
     using Mutex = std::recursive_mutex;
@@ -88,6 +173,10 @@ public:
     bool ReadMode() const;
     Mutex& GetMutex() const;
 
+    /// Number of threads used to serialize and compress the histograms when they are written at destruction.
+    size_t GetNumberOfWriteThreads() const;
+    void SetNumberOfWriteThreads(size_t n_threads);
+
     void AddHistogram(HistPtr hist);
     const HistContainer& GetHistograms() const;
 
@@ -117,11 +206,29 @@ public:
     void AddEntry(Entry& entry);
     const EntryContainer& GetEntries() const;
 
+    /// In the sharded mode each thread fills private copies of the histograms, so no locks are needed to fill
+    /// them. The shards are merged into the main histograms in the order of the shard indices by MergeShards,
+    /// which is also called when the entries are destroyed, before the histograms are written. The sharded mode
+    /// should be enabled before the worker threads are started.
+    void EnableSharding(bool enable = true);
+    bool IsSharded() const;
+    /// Bind the calling thread to the shard with the given index. Workers that process fixed parts of the input
+    /// should call it to get the same result in every run. Otherwise, the indices are assigned in the order of
+    /// the first access.
+    void SetThreadShardIndex(size_t index);
+    size_t GetThreadShardIndex();
+    /// Add the content of the shards to the main histograms and reset the shards. Must not run concurrently with
+    /// the filling of the shards, so it should be called when the workers have finished filling.
+    void MergeShards();
+
     template<typename Histogram>
     std::map<std::string, AnalyzerDataEntry<Histogram>*> GetEntriesEx() const;
     template<typename Histogram>
     AnalyzerDataEntry<Histogram>& GetEntryEx(const std::string& name) const;
 
+private:
+    void WriteHistograms();
+
 private:
     std::shared_ptr<TFile> outputFile;
     TDirectory* directory;
@@ -129,6 +236,10 @@ private:
     EntryContainer entries;
     HistContainer histograms;
     std::unique_ptr<Mutex> mutex;
+    size_t nWriteThreads{1};
+    bool sharded{false};
+    const size_t uid;
+    std::set<size_t> shardIndices;
 };
 
 
@@ -152,32 +263,59 @@ struct AnalyzerDataEntry : AnalyzerDataEntryBase  {
         SetMasterHist(std::forward<Args>(args)...);
     }
 
-    Hist& operator()()
-    {
-        std::lock_guard<Mutex> lock(GetMutex());
-        if(!default_hist) {
-            default_hist = std::make_shared<Hist>(GetMasterHist());
-            histograms[""] = default_hist;
-            data->AddHistogram(default_hist);
+    // The entries are destroyed before AnalyzerData writes the histograms, so the shards are merged here.
+    virtual ~AnalyzerDataEntry() { MergeShards(); }
+
+    /// Reference to a histogram of the entry resolved once. In the sharded mode it points to the shard of the
+    /// thread that dereferences the handle. The shard is looked up by the key only when the handle is dereferenced
+    /// by a different thread than the previous time, so each worker thread should use its own copy of the handle.
+    class Handle {
+    public:
+        Handle() {}
+
+        Hist& operator*() const
+        {
+            if(!entry->data->IsSharded())
+                return *hist;
+            const auto thread_id = std::this_thread::get_id();
+            if(!shard || shard_thread != thread_id) {
+                shard = &entry->GetShard(key);
+                shard_thread = thread_id;
+            }
+            return *shard;
         }
-        return *default_hist;
-    }
 
+        Hist* operator->() const { return &**this; }
+        const std::string& Key() const { return key; }
+
+    private:
+        friend struct AnalyzerDataEntry;
+        Handle(AnalyzerDataEntry& _entry, const std::string& _key, Hist& _hist) :
+            entry(&_entry), key(_key), hist(&_hist) {}
+
+    private:
+        AnalyzerDataEntry* entry{nullptr};
+        std::string key;
+        Hist* hist{nullptr};
+        mutable Hist* shard{nullptr};
+        mutable std::thread::id shard_thread;
+    };
+
+    Hist& operator()() { return Resolve(""); }
+
+    /// Suffixes that consist only of integral and enum values are looked up in a thread-local table
+    /// without building the key string, which is created only when the histogram is accessed for the first time.
     template<typename ...KeySuffix>
     Hist& operator()(KeySuffix&&... suffix)
     {
-        std::lock_guard<Mutex> lock(GetMutex());
+        return Resolve(detail::IsTypedSuffix<KeySuffix...>(), std::forward<KeySuffix>(suffix)...);
+    }
+
+    template<typename ...KeySuffix>
+    Handle GetHandle(KeySuffix&&... suffix)
+    {
         const auto key = SuffixToKey(std::forward<KeySuffix>(suffix)...);
-        if(key == "")
-            return (*this)();
-        auto iter = histograms.find(key);
-        if(iter != histograms.end())
-            return *iter->second;
-        auto hist = std::make_shared<Hist>(GetMasterHist());
-        hist->SetName(FullName(key));
-        data->AddHistogram(hist);
-        histograms[key] = hist;
-        return *hist;
+        return Handle(*this, key, GetHistogram(key));
     }
 
     template<typename KeySuffix, typename... Args>
@@ -188,9 +326,11 @@ struct AnalyzerDataEntry : AnalyzerDataEntryBase  {
         auto iter = histograms.find(key);
         if(iter != histograms.end())
             throw analysis::exception("Histogram with suffix '%1%' already exists in '%2%'.") % key % Name();
-        auto hist = std::make_shared<Hist>(FullName(key), std::forward<Args>(args)...);
+        const std::string full_name = FullName(key);
+        auto hist = std::make_shared<Hist>(full_name, args...);
         data->AddHistogram(hist);
         histograms[key] = hist;
+        empty_hist_factories[key] = [full_name, args...]() { return std::make_shared<Hist>(full_name, args...); };
     }
 
     template<typename KeySuffix>
@@ -203,6 +343,12 @@ struct AnalyzerDataEntry : AnalyzerDataEntryBase  {
             throw analysis::exception("Histogram with suffix '%1%' already exists in '%2%'.") % key % Name();
         data->AddHistogram(hist);
         histograms[key] = hist;
+        // The constructor arguments of an external histogram are unknown, so its shards are copies without content.
+        empty_hist_factories[key] = [hist]() {
+            auto empty_hist = std::make_shared<Hist>(*hist);
+            empty_hist->ResetContent();
+            return empty_hist;
+        };
     }
 
     const HistPtrMap& GetHistograms() const { return histograms; }
@@ -225,24 +371,126 @@ struct AnalyzerDataEntry : AnalyzerDataEntryBase  {
 
     std::string FullName(const std::string& key) const { return Name() + "_" + key; }
 
-    Hist& Read() { return ReadFromDirectory((*this)()); }
+    Hist& Read() { return ReadFromDirectory(GetHistogram("")); }
     template<typename KeySuffix>
-    Hist& Read(KeySuffix&& suffix) { return ReadFromDirectory((*this)(std::forward<KeySuffix>(suffix))); }
+    Hist& Read(KeySuffix&& suffix)
+    {
+        return ReadFromDirectory(GetHistogram(SuffixToKey(std::forward<KeySuffix>(suffix))));
+    }
+
+    virtual void MergeShards() override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        for(auto& shard : shards) {
+            for(auto& hist : shard.second) {
+                histograms.at(hist.first)->AddShard(*hist.second);
+                hist.second->ResetContent();
+            }
+        }
+    }
 
     static std::string SuffixToKey() { return ""; }
 
     template<typename T, typename ...KeySuffix>
     static std::string SuffixToKey(T&& first_suffix, KeySuffix&&... suffix)
     {
-        std::ostringstream ss_suffix;
-        ss_suffix << first_suffix;
+        std::string key = detail::SuffixToString(first_suffix);
         const auto other_suffix = SuffixToKey(std::forward<KeySuffix>(suffix)...);
-        if(other_suffix.size())
-            ss_suffix << "_" << other_suffix;
-        return ss_suffix.str();
+        if(other_suffix.size()) {
+            key += "_";
+            key += other_suffix;
+        }
+        return key;
     }
 
 private:
+    using TypedHistMap = std::unordered_map<detail::TypedSuffixKey, Hist*, detail::TypedSuffixKeyHash>;
+
+    Hist& Resolve(const std::string& key) { return data->IsSharded() ? GetShard(key) : GetHistogram(key); }
+
+    template<typename ...KeySuffix>
+    Hist& Resolve(std::false_type /*is_typed*/, KeySuffix&&... suffix)
+    {
+        return Resolve(SuffixToKey(std::forward<KeySuffix>(suffix)...));
+    }
+
+    template<typename ...KeySuffix>
+    Hist& Resolve(std::true_type /*is_typed*/, KeySuffix&&... suffix)
+    {
+        TypedHistMap& typed_histograms = GetThreadTypedHistograms();
+        const auto typed_key = detail::MakeTypedSuffixKey(suffix...);
+        auto iter = typed_histograms.find(typed_key);
+        if(iter != typed_histograms.end())
+            return *iter->second;
+        Hist& hist = Resolve(SuffixToKey(std::forward<KeySuffix>(suffix)...));
+        typed_histograms[typed_key] = &hist;
+        return hist;
+    }
+
+    // Separate tables are kept for the main histograms and for the shards of the thread.
+    TypedHistMap& GetThreadTypedHistograms()
+    {
+        static thread_local detail::ThreadUidTable<std::array<TypedHistMap, 2>> thread_histograms;
+        return thread_histograms[uid][data->IsSharded() ? 1 : 0];
+    }
+
+    Hist& GetHistogram(const std::string& key)
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        if(key == "") {
+            if(!default_hist) {
+                default_hist = std::make_shared<Hist>(GetMasterHist());
+                histograms[""] = default_hist;
+                data->AddHistogram(default_hist);
+            }
+            return *default_hist;
+        }
+        auto iter = histograms.find(key);
+        if(iter != histograms.end())
+            return *iter->second;
+        auto hist = std::make_shared<Hist>(GetMasterHist());
+        hist->SetName(FullName(key));
+        data->AddHistogram(hist);
+        histograms[key] = hist;
+        return *hist;
+    }
+
+    // Only the calling thread accesses its shard, so the lock is taken only when a histogram is used
+    // for the first time in the thread.
+    Hist& GetShard(const std::string& key)
+    {
+        static thread_local detail::ThreadUidTable<HistPtrMap*> thread_shards;
+        HistPtrMap*& shard = thread_shards[uid];
+        if(!shard) {
+            const size_t shard_index = data->GetThreadShardIndex();
+            std::lock_guard<Mutex> lock(GetMutex());
+            shard = &shards[shard_index];
+        }
+        auto iter = shard->find(key);
+        if(iter != shard->end())
+            return *iter->second;
+
+        std::lock_guard<Mutex> lock(GetMutex());
+        GetHistogram(key); // MergeShards adds the shard to the main histogram, so it should exist
+        auto hist = CreateEmptyHistogram(key);
+        hist->SetOutputDirectory(nullptr);
+        (*shard)[key] = hist;
+        return *hist;
+    }
+
+    // Histogram with the same binning as the main histogram with the given key, which is created from the master
+    // histogram unless it was added by Emplace or Set.
+    HistPtr CreateEmptyHistogram(const std::string& key)
+    {
+        auto factory = empty_hist_factories.find(key);
+        if(factory != empty_hist_factories.end())
+            return factory->second();
+        auto hist = std::make_shared<Hist>(GetMasterHist());
+        if(!key.empty())
+            hist->SetName(FullName(key));
+        return hist;
+    }
+
     Hist& ReadFromDirectory(Hist& hist)
     {
         std::lock_guard<Mutex> lock(GetMutex());
@@ -258,6 +506,8 @@ private:
 private:
     HistPtr master_hist, default_hist;
     HistPtrMap histograms;
+    std::unordered_map<std::string, std::function<HistPtr()>> empty_hist_factories;
+    std::map<size_t, HistPtrMap> shards;
 };
 
 template<typename Histogram>
@@ -0,0 +1,51 @@
+/*! Measure the compression ratio and speed of the branch data for different compression settings.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <TBranch.h>
+#include "RootCompression.h"
+
+namespace root_ext {
+
+struct CompressionBenchmarkResult {
+    CompressionSetting setting;
+    Long64_t raw_size{0}, zip_size{0};
+    double compress_time{0}, decompress_time{0}; // in seconds
+
+    explicit CompressionBenchmarkResult(const CompressionSetting& _setting);
+    double CompressionFactor() const;
+    double CompressSpeed() const; // MB/s of uncompressed data
+    double DecompressSpeed() const; // MB/s of uncompressed data
+
+    // Estimated time in seconds to read 1 GB of uncompressed data assuming that storage delivers
+    // io_bandwidth MB/s of compressed data.
+    double ReadTime(double io_bandwidth) const;
+
+    CompressionBenchmarkResult& operator+=(const CompressionBenchmarkResult& other);
+};
+
+class CompressionBenchmark {
+public:
+    using Buffer = CompressionBuffer;
+    using ResultCollection = std::vector<CompressionBenchmarkResult>;
+
+    static const std::vector<CompressionSetting>& DefaultSettings();
+
+    explicit CompressionBenchmark(size_t _max_baskets, const std::vector<CompressionSetting>& _settings =
+                                  DefaultSettings());
+
+    // Re-compress up to max_baskets baskets evenly sampled from the branch and all its sub-branches.
+    ResultCollection Run(TBranch& branch) const;
+
+private:
+    void CollectBaskets(TBranch& branch, std::vector<Buffer>& baskets) const;
+
+private:
+    size_t max_baskets;
+    std::vector<CompressionSetting> settings;
+};
+
+} // namespace root_ext
@@ -0,0 +1,51 @@
+/*! Definition of a persistent index that maps event identifiers to tree entries.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <TFile.h>
+#include <TTree.h>
+#include "EventIdentifier.h"
+
+namespace analysis {
+
+class EventIndex {
+public:
+    using IdType = EventIdentifier::IdType;
+
+    static std::string IndexName(const std::string& tree_name);
+    static std::string SidecarFileName(const std::string& file_name);
+    // Identifies the file and the content of the tree, so that the index built for another version of the tree
+    // is not used.
+    static std::string SourceId(const TTree& tree);
+
+    // Build the index for the tree in a single pass over the event id branches and store it in the output
+    // directory as a tree sorted by (sampleId, run, lumi, evt, entry).
+    static void Build(TTree& tree, const std::vector<std::string>& id_branches, TDirectory& output_dir,
+                      const std::string& index_name);
+
+    // Look for the index first inside the file itself, then in the sidecar file.
+    // Returns nullptr if no index built with the same id branches for the same version of the tree is found.
+    static std::shared_ptr<EventIndex> TryOpen(const std::shared_ptr<TFile>& file, const std::string& tree_name,
+                                               const std::vector<std::string>& id_branches);
+
+    EventIndex(const std::shared_ptr<TFile>& _file, TTree* _index_tree);
+    EventIndex(const EventIndex&) = delete;
+    EventIndex& operator=(const EventIndex&) = delete;
+
+    Long64_t GetEntries() const;
+    std::vector<Long64_t> FindEntries(const EventIdentifier& event_id, size_t max_matches) const;
+
+private:
+    EventIdentifier ReadId(Long64_t n) const;
+
+private:
+    std::shared_ptr<TFile> file;
+    TTree* index_tree;
+    mutable EventIdentifier current_id;
+    mutable Long64_t current_entry;
+};
+
+} // namespace analysis
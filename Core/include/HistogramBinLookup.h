@@ -0,0 +1,125 @@
+/*! Bin lookup for batches of values used by SmartHistogram::FillN.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <TAxis.h>
+
+namespace root_ext {
+namespace detail {
+
+// Number of values processed at once by FillN, so the bin indices of a chunk stay in the L1 cache.
+constexpr size_t FillChunkSize = 1024;
+
+// Bin of a value that is equal to the upper edge of the axis.
+enum class UpperEdgeBin {
+    Overflow, // as TAxis::FindFixBin, used by TH1::Fill and TH1::FillN
+    LastBin   // as analysis::RangeWithStep::find_bin
+};
+
+// Finds ROOT bin indices of an axis for a batch of values. Values below min go to the underflow bin, values above max
+// and NaN to the overflow bin. For UpperEdgeBin::Overflow the bins are exactly the same as TAxis::FindFixBin returns.
+// For UpperEdgeBin::LastBin the bin inside [min, max] is the same as RangeWithStep::find_bin returns (plus one for
+// the underflow bin), so the upper edge of the axis belongs to the last bin.
+class AxisBinLookup {
+public:
+    AxisBinLookup(const TAxis& axis, UpperEdgeBin _upper_edge) :
+        n_bins(axis.GetNbins()), min(axis.GetXmin()), max(axis.GetXmax()),
+        width((axis.GetXmax() - axis.GetXmin()) / axis.GetNbins()), upper_edge(_upper_edge)
+    {
+        if(axis.IsVariableBinSize()) {
+            const TArrayD* bins = axis.GetXbins();
+            edges.assign(bins->GetArray(), bins->GetArray() + bins->GetSize());
+        }
+    }
+
+    Int_t GetNbins() const { return n_bins; }
+    bool IsInRange(Int_t bin) const { return bin > 0 && bin <= n_bins; }
+
+    void FindBins(size_t n_values, const double* values, Int_t* bins) const
+    {
+        if(!edges.empty())
+            FindVariableBins(n_values, values, bins);
+        else if(upper_edge == UpperEdgeBin::Overflow)
+            FindUniformBinsAsRoot(n_values, values, bins);
+        else
+            FindUniformBins(n_values, values, bins);
+    }
+
+private:
+    // The loops have no branches and no calls, so they are vectorized by the compiler.
+    void FindUniformBins(size_t n_values, const double* values, Int_t* bins) const
+    {
+        const double x_min = min, x_max = max, bin_width = width, last_bin = n_bins - 1, overflow = n_bins;
+        for(size_t n = 0; n < n_values; ++n) {
+            const double x = values[n];
+            const double position = (x - x_min) / bin_width;
+            const double in_range = position < last_bin ? position : last_bin;
+            const double bin = x < x_min ? -1. : (x <= x_max ? in_range : overflow);
+            bins[n] = static_cast<Int_t>(bin) + 1;
+        }
+    }
+
+    // Same expression as in TAxis::FindFixBin, so the rounding near the bin edges is also the same.
+    void FindUniformBinsAsRoot(size_t n_values, const double* values, Int_t* bins) const
+    {
+        const double x_min = min, x_max = max, range = max - min, n_bins_x = n_bins, overflow = n_bins;
+        for(size_t n = 0; n < n_values; ++n) {
+            const double x = values[n];
+            const double position = n_bins_x * (x - x_min) / range;
+            const double bin = x < x_min ? -1. : (x < x_max ? position : overflow);
+            bins[n] = static_cast<Int_t>(bin) + 1;
+        }
+    }
+
+    // Binary search with a fixed number of steps, where the comparison result only selects the next position.
+    void FindVariableBins(size_t n_values, const double* values, Int_t* bins) const
+    {
+        const double* first = edges.data();
+        const size_t n_edges = edges.size();
+        const double last_edge = edges.back();
+        const Int_t upper_edge_bin = upper_edge == UpperEdgeBin::LastBin ? n_bins : n_bins + 1;
+        for(size_t n = 0; n < n_values; ++n) {
+            const double x = values[n];
+            const double* base = first;
+            for(size_t length = n_edges; length > 1; length -= length / 2)
+                base = base[length / 2] <= x ? base + length / 2 : base;
+            const Int_t n_below = static_cast<Int_t>(base - first) + (*base <= x ? 1 : 0);
+            bins[n] = x < last_edge ? n_below : (x == last_edge ? upper_edge_bin : n_bins + 1);
+        }
+    }
+
+private:
+    Int_t n_bins;
+    double min, max, width;
+    UpperEdgeBin upper_edge;
+    std::vector<double> edges; // empty for the uniform binning
+};
+
+// Second pass of the batch filling: add the weights to the bins found by AxisBinLookup.
+// sum_w2 can be null if the squares of the weights are not stored, weights can be null for the unit weights.
+inline void AccumulateBinContents(size_t n_values, const Int_t* bins, const double* weights, double* content,
+                                  double* sum_w2)
+{
+    if(!weights) {
+        for(size_t n = 0; n < n_values; ++n)
+            content[bins[n]] += 1;
+        if(sum_w2) {
+            for(size_t n = 0; n < n_values; ++n)
+                sum_w2[bins[n]] += 1;
+        }
+        return;
+    }
+    for(size_t n = 0; n < n_values; ++n)
+        content[bins[n]] += weights[n];
+    if(sum_w2) {
+        for(size_t n = 0; n < n_values; ++n)
+            sum_w2[bins[n]] += weights[n] * weights[n];
+    }
+}
+
+} // namespace detail
+} // namespace root_ext
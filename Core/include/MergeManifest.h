@@ -0,0 +1,62 @@
+/*! Manifest of the input files that are already merged into the output file.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace analysis {
+
+// The manifest is stored next to the output as <output>.manifest. A new version of the output is first written
+// into <output>.tmp, then the new manifest is written into <output>.manifest.tmp, and finally both are renamed.
+// The new manifest contains the checksum of the new output, which allows Recover to find out at which step
+// an interrupted run has stopped.
+class MergeManifest {
+public:
+    struct FileRecord {
+        std::string name;
+        uintmax_t size{0};
+        std::time_t mtime{0};
+        uint32_t checksum{0};
+
+        static FileRecord Create(const std::string& file_name);
+        static uint32_t ComputeChecksum(const std::string& file_name);
+        bool HasSameSizeAndTime(const FileRecord& other) const;
+    };
+
+    static std::string ManifestName(const std::string& output);
+    static std::string TemporaryName(const std::string& file_name);
+
+    explicit MergeManifest(const std::string& _output);
+
+    // Complete or roll back the commit of an interrupted run and load the manifest.
+    void Recover();
+
+    bool HasOutput() const;
+    const std::string& GetOutput() const;
+    std::string GetTemporaryOutput() const;
+
+    // Select inputs that are not merged yet. Inputs that are already merged are skipped if their size and
+    // modification time or checksum are unchanged, otherwise an exception is thrown.
+    std::vector<std::string> SelectNewInputs(const std::vector<std::string>& input_files);
+
+    // Replace the output with the temporary output and add the selected new inputs to the manifest.
+    void Commit();
+
+private:
+    void Read(const std::string& file_name, FileRecord& output_record, std::map<std::string, FileRecord>& records)
+        const;
+    void Write(const std::string& file_name) const;
+
+private:
+    std::string output;
+    bool has_output{false};
+    FileRecord output_record;
+    std::map<std::string, FileRecord> inputs, new_inputs;
+};
+
+} // namespace analysis
@@ -0,0 +1,33 @@
+/*! Write ROOT objects into a directory with the serialization and compression done by several threads.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <TDirectory.h>
+#include <TFile.h>
+
+namespace root_ext {
+
+// Object streamed and compressed in the same way as TKey does it, ready to be appended to the file.
+// The file_end is the expected position of the key, which decides if the key uses 64-bit offsets.
+struct SerializedObject {
+    const TObject* object{nullptr};
+    std::string name, title, class_name;
+    Int_t key_length{0}, raw_size{0}; // the key length depends on the file size, see TKey::Build
+    std::vector<char> data; // compressed object, or the streamed object as is if it can't be compressed
+
+    SerializedObject() {}
+    SerializedObject(const TObject& _object, TFile& file, Long64_t file_end);
+};
+
+// Append a new key with the serialized object to the directory.
+// An existing key with the same name is replaced, as WriteObject does.
+void WriteSerializedObject(TDirectory& dir, const SerializedObject& object);
+
+// Serialize and compress the objects using n_threads workers, while the calling thread appends the keys to the
+// directory in the order of the input vector, so the output does not depend on the number of threads.
+void WriteObjectsParallel(TDirectory& dir, const std::vector<const TObject*>& objects, size_t n_threads);
+
+} // namespace root_ext
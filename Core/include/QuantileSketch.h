@@ -0,0 +1,248 @@
+/*! Mergeable streaming quantile sketch with a bounded relative error on the value.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "exception.h"
+
+namespace analysis {
+
+// Values are counted in logarithmic buckets: every interval [2^(e-1), 2^e) is split into 2^precision_bits buckets
+// of equal width, so each value is within a relative distance of 2^-precision_bits from the bucket edges.
+// The weighted sums are kept exactly for every bucket, and the sketches are merged by adding the buckets, so the
+// result does not depend on the order of fills and merges. When the number of buckets exceeds max_buckets,
+// the precision is reduced by one bit, which merges pairs of adjacent buckets.
+class QuantileSketch {
+public:
+    struct Bucket {
+        double sum_w{0}, sum_w2{0};
+
+        Bucket& operator+=(const Bucket& other)
+        {
+            sum_w += other.sum_w;
+            sum_w2 += other.sum_w2;
+            return *this;
+        }
+    };
+    using BucketMap = std::map<int64_t, Bucket>; // ordered by the value
+    using Serialized = std::vector<double>;
+
+    static constexpr unsigned DefaultPrecisionBits = 7;
+    static constexpr size_t DefaultMaxBuckets = 4096;
+
+    explicit QuantileSketch(unsigned _precision_bits = DefaultPrecisionBits, size_t _max_buckets = DefaultMaxBuckets) :
+        precision_bits(_precision_bits), max_buckets(std::max<size_t>(_max_buckets, 2))
+    {
+        if(precision_bits > MaxPrecisionBits)
+            throw exception("QuantileSketch: precision should be at most %1% bits.")
+                % static_cast<unsigned>(MaxPrecisionBits);
+    }
+
+    void Add(double value, double weight = 1)
+    {
+        if(std::isnan(value)) return;
+        Bucket& bucket = buckets[ToKey(value)];
+        bucket.sum_w += weight;
+        bucket.sum_w2 += weight * weight;
+        ++n_entries;
+        if(std::isfinite(value)) {
+            min_value = std::min(min_value, value);
+            max_value = std::max(max_value, value);
+        }
+        if(buckets.size() > max_buckets && precision_bits > 0)
+            ReducePrecision(precision_bits - 1);
+    }
+
+    void Merge(const QuantileSketch& other)
+    {
+        if(other.precision_bits < precision_bits)
+            ReducePrecision(other.precision_bits);
+        if(other.precision_bits > precision_bits) {
+            QuantileSketch reduced(other);
+            reduced.ReducePrecision(precision_bits);
+            return Merge(reduced);
+        }
+        for(const auto& bucket : other.buckets)
+            buckets[bucket.first] += bucket.second;
+        n_entries += other.n_entries;
+        min_value = std::min(min_value, other.min_value);
+        max_value = std::max(max_value, other.max_value);
+        while(buckets.size() > max_buckets && precision_bits > 0)
+            ReducePrecision(precision_bits - 1);
+    }
+
+    void Clear()
+    {
+        buckets.clear();
+        n_entries = 0;
+        min_value = std::numeric_limits<double>::infinity();
+        max_value = -std::numeric_limits<double>::infinity();
+    }
+
+    bool Empty() const { return n_entries == 0; }
+    size_t GetEntries() const { return n_entries; }
+    unsigned GetPrecisionBits() const { return precision_bits; }
+    double GetMinValue() const { return min_value; }
+    double GetMaxValue() const { return max_value; }
+    const BucketMap& GetBuckets() const { return buckets; }
+
+    double GetSumOfWeights() const
+    {
+        double sum_w = 0;
+        for(const auto& bucket : buckets)
+            sum_w += bucket.second.sum_w;
+        return sum_w;
+    }
+
+    // Center of the bucket. For the buckets of the infinite values, the infinite value itself.
+    double BucketValue(int64_t key) const
+    {
+        if(key == PositiveInfinityKey) return std::numeric_limits<double>::infinity();
+        if(key == NegativeInfinityKey) return -std::numeric_limits<double>::infinity();
+        if(key == 0) return 0;
+        const double abs_value = (LowEdge(std::abs(key)) + LowEdge(std::abs(key) + 1)) / 2;
+        return key > 0 ? abs_value : -abs_value;
+    }
+
+    // Interval of the values counted in the bucket. For the buckets of zero and of the infinite values,
+    // both edges are equal to the value itself.
+    std::pair<double, double> BucketEdges(int64_t key) const
+    {
+        if(key == 0 || key == PositiveInfinityKey || key == NegativeInfinityKey) {
+            const double value = BucketValue(key);
+            return std::make_pair(value, value);
+        }
+        const double low = LowEdge(std::abs(key)), high = LowEdge(std::abs(key) + 1);
+        return key > 0 ? std::make_pair(low, high) : std::make_pair(-high, -low);
+    }
+
+    // Value below which the fraction q of the total weight is found, up to the precision of the buckets.
+    // The weights are expected to be non-negative.
+    double Quantile(double q) const
+    {
+        if(buckets.empty())
+            throw exception("QuantileSketch: can't compute a quantile of an empty sketch.");
+        if(q <= 0) return min_value;
+        if(q >= 1) return max_value;
+        const double target = q * GetSumOfWeights();
+        double cumulative = 0;
+        for(const auto& bucket : buckets) {
+            cumulative += bucket.second.sum_w;
+            if(cumulative >= target)
+                return std::min(std::max(BucketValue(bucket.first), min_value), max_value);
+        }
+        return max_value;
+    }
+
+    // Flat representation that can be stored in a file and merged in another job.
+    Serialized Serialize() const
+    {
+        Serialized result = { static_cast<double>(precision_bits), static_cast<double>(max_buckets),
+                              static_cast<double>(n_entries), min_value, max_value };
+        for(const auto& bucket : buckets) {
+            result.push_back(KeyToDouble(bucket.first));
+            result.push_back(bucket.second.sum_w);
+            result.push_back(bucket.second.sum_w2);
+        }
+        return result;
+    }
+
+    static QuantileSketch Deserialize(const Serialized& data)
+    {
+        static constexpr size_t header_size = 5, bucket_size = 3;
+        if(data.size() < header_size || (data.size() - header_size) % bucket_size != 0)
+            throw exception("QuantileSketch: invalid serialized data.");
+        QuantileSketch sketch(static_cast<unsigned>(data.at(0)), static_cast<size_t>(data.at(1)));
+        sketch.n_entries = static_cast<size_t>(data.at(2));
+        sketch.min_value = data.at(3);
+        sketch.max_value = data.at(4);
+        for(size_t n = header_size; n < data.size(); n += bucket_size) {
+            Bucket& bucket = sketch.buckets[KeyFromDouble(data.at(n))];
+            bucket.sum_w = data.at(n + 1);
+            bucket.sum_w2 = data.at(n + 2);
+        }
+        return sketch;
+    }
+
+private:
+    static constexpr unsigned MaxPrecisionBits = 20;
+    static constexpr int ExponentOffset = 1100; // makes the exponent of any positive finite double positive
+    static constexpr int64_t PositiveInfinityKey = std::numeric_limits<int64_t>::max();
+    static constexpr int64_t NegativeInfinityKey = std::numeric_limits<int64_t>::min();
+
+    // Key of zero is 0, positive values have positive keys and negative values have negative keys,
+    // and the order of the keys follows the order of the values.
+    int64_t ToKey(double value) const
+    {
+        if(value == 0) return 0;
+        if(std::isinf(value))
+            return value > 0 ? PositiveInfinityKey : NegativeInfinityKey;
+        int exponent;
+        const double fraction = std::frexp(std::abs(value), &exponent); // in [0.5, 1)
+        const int64_t n_sub_buckets = int64_t(1) << precision_bits;
+        const int64_t sub_bucket = std::min(static_cast<int64_t>((fraction - 0.5) * 2 * n_sub_buckets),
+                                            n_sub_buckets - 1);
+        const int64_t abs_key = (exponent + ExponentOffset) * n_sub_buckets + sub_bucket + 1;
+        return value > 0 ? abs_key : -abs_key;
+    }
+
+    static double KeyToDouble(int64_t key)
+    {
+        if(key == PositiveInfinityKey) return std::numeric_limits<double>::infinity();
+        if(key == NegativeInfinityKey) return -std::numeric_limits<double>::infinity();
+        return static_cast<double>(key);
+    }
+
+    static int64_t KeyFromDouble(double key)
+    {
+        if(std::isinf(key))
+            return key > 0 ? PositiveInfinityKey : NegativeInfinityKey;
+        return static_cast<int64_t>(key);
+    }
+
+    double LowEdge(int64_t abs_key) const
+    {
+        const int64_t n_sub_buckets = int64_t(1) << precision_bits;
+        const int64_t exponent = (abs_key - 1) / n_sub_buckets - ExponentOffset;
+        const int64_t sub_bucket = (abs_key - 1) % n_sub_buckets;
+        return std::ldexp(0.5 + 0.5 * sub_bucket / n_sub_buckets, static_cast<int>(exponent));
+    }
+
+    void ReducePrecision(unsigned new_precision_bits)
+    {
+        if(new_precision_bits >= precision_bits) return;
+        const unsigned shift = precision_bits - new_precision_bits;
+        BucketMap reduced;
+        for(const auto& bucket : buckets) {
+            int64_t key = bucket.first;
+            if(key != 0 && key != PositiveInfinityKey && key != NegativeInfinityKey) {
+                const int64_t abs_key = std::abs(key) - 1;
+                const int64_t exponent = abs_key >> precision_bits;
+                const int64_t sub_bucket = (abs_key & ((int64_t(1) << precision_bits) - 1)) >> shift;
+                const int64_t new_abs_key = (exponent << new_precision_bits) + sub_bucket + 1;
+                key = key > 0 ? new_abs_key : -new_abs_key;
+            }
+            reduced[key] += bucket.second;
+        }
+        buckets = std::move(reduced);
+        precision_bits = new_precision_bits;
+    }
+
+private:
+    unsigned precision_bits;
+    size_t max_buckets;
+    BucketMap buckets;
+    size_t n_entries{0};
+    double min_value{std::numeric_limits<double>::infinity()};
+    double max_value{-std::numeric_limits<double>::infinity()};
+};
+
+} // namespace analysis
@@ -0,0 +1,31 @@
+/*! Compression of memory buffers in the same block format as ROOT uses for the baskets and keys.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <Compression.h>
+
+namespace root_ext {
+
+struct CompressionSetting {
+    ROOT::ECompressionAlgorithm algorithm;
+    int level;
+
+    CompressionSetting(ROOT::ECompressionAlgorithm _algorithm, int _level);
+    int Settings() const;
+    std::string ToString() const;
+    static std::string ToString(int settings);
+};
+
+using CompressionBuffer = std::vector<char>;
+
+// Compress the data block by block. If any block can't be compressed or the compressed size is not smaller,
+// the data is returned as is, so the caller can detect it by comparing the sizes.
+CompressionBuffer CompressBuffer(const CompressionBuffer& data, const CompressionSetting& setting);
+
+// Inverse of CompressBuffer: zip_data of size raw_size is considered to be uncompressed.
+CompressionBuffer DecompressBuffer(const CompressionBuffer& zip_data, size_t raw_size);
+
+} // namespace root_ext
@@ -5,12 +5,14 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 
 #include <memory>
 #include <map>
+#include <set>
 
 #include <TROOT.h>
 #include <TClass.h>
 #include <TLorentzVector.h>
 #include <TMatrixD.h>
 #include <TFile.h>
+#include <TKey.h>
 #include <Compression.h>
 
 #include "exception.h"
@@ -83,6 +85,22 @@ Object* ReadCloneObject(TDirectory& file, const std::string& original_name, cons
     return CloneObject(*original_object, new_name, detach_from_file);
 }
 
+/// Copies keys from one file into other directories without deserializing the objects.
+/// The streamer infos of the copied classes are taken from the source file, so the destination file stays readable.
+/// Objects of the classes without streamer info in the source file are read and written in the usual way.
+class RawKeyCopier {
+public:
+    explicit RawKeyCopier(TFile& source_file);
+    void Copy(TKey& key, TDirectory& destination);
+
+private:
+    bool CopyStreamerInfo(TFile& destination_file, const std::string& class_name);
+
+private:
+    std::unique_ptr<TList> source_infos;
+    std::set<std::pair<TFile*, std::string>> copied_infos;
+};
+
 TDirectory* GetDirectory(TDirectory& root_dir, const std::string& name, bool create_if_needed = true);
 
 enum class ClassInheritance { TH1, TTree, TDirectory };
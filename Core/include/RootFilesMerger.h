@@ -4,6 +4,9 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 #pragma once
 
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
 #include <unordered_map>
 #include <TROOT.h>
 #include <TKey.h>
@@ -19,23 +22,33 @@ namespace analysis {
 
 class RootFilesMerger {
 public:
+    // Histograms are merged along a binary tree over the input file indices: a node (level, index) is the sum of
+    // the histograms from the files [index * 2^level, (index + 1) * 2^level). Two sibling nodes are merged as soon as
+    // both of them are available, so the merging is done in parallel by the threads that read the files, while the
+    // result does not depend on the order in which the files are processed.
     struct HistDescriptor {
-        static constexpr size_t MergeThreshold = 20;
         using HistPtr = std::unique_ptr<TH1>;
-        std::vector<HistPtr> hists;
+        using NodeId = std::pair<size_t, size_t>; // level, index
+        std::map<NodeId, HistPtr> nodes;
+        std::mutex mutex;
+
         HistDescriptor();
-        void AddHistogram(HistPtr&& new_hist);
+        void AddHistogram(size_t file_index, HistPtr&& new_hist);
         const HistPtr& GetMergedHisto() const;
         void Merge();
+        static void MergeHistograms(TH1& first, TH1& second);
     };
 
     struct TreeDescriptor {
         using ChainPtr = std::unique_ptr<TChain>;
         static std::atomic<size_t>& NumberOfFiles();
-        std::vector<std::string> file_names;
+        std::vector<std::pair<size_t, std::string>> file_names;
+        std::mutex mutex;
+
         TreeDescriptor();
-        void AddFile(const std::string& file_name);
-        ChainPtr CreateChain(const std::string& full_name) const;
+        void AddFile(size_t file_index, const std::string& file_name);
+        std::vector<std::string> GetFileNames();
+        ChainPtr CreateChain(const std::string& full_name);
     };
 
     struct Key {
@@ -59,8 +72,16 @@ public:
     struct ObjectCollection {
         HistCollection hists;
         TreeCollection trees;
+        std::unordered_map<Key, size_t, KeyHash> hist_sizes; // maximal uncompressed size over input files
+        std::mutex mutex;
+
+        HistDescriptor& GetHist(const Key& key);
+        TreeDescriptor& GetTree(const Key& key);
+        void UpdateHistSize(const Key& key, size_t size);
     };
 
+    enum class HistogramAction { Skip, Read, Scan };
+
     using HistPtr = HistDescriptor::HistPtr;
     using ChainPtr = TreeDescriptor::ChainPtr;
 
@@ -69,24 +90,58 @@ public:
                     const std::string& exclude_dir_list, unsigned n_threads, ROOT::ECompressionAlgorithm compression,
                     int compression_level);
 
+    RootFilesMerger(const std::string& output, const std::vector<std::string>& _input_files, unsigned n_threads,
+                    ROOT::ECompressionAlgorithm compression, int compression_level);
+
     virtual ~RootFilesMerger() {}
 
     void Process(bool process_histograms, bool process_trees);
+
+    // Copy the compressed baskets of the input trees without recompressing them, if the tree structure and
+    // the compression settings of the input are the same as for the output. Otherwise the file is merged
+    // entry by entry.
+    void SetFastTreeMerge(bool value) { fast_tree_merge = value; }
+
+    // If non-zero, histograms are processed in batches of directories, so that the estimated memory needed to
+    // merge one batch does not exceed the budget. The merged histograms of each batch are written to the output
+    // before the next batch is read. A directory that alone exceeds the budget forms a separate batch.
+    void SetMemoryBudget(size_t bytes) { memory_budget = bytes; }
     static std::vector<std::string> FindInputFiles(const std::vector<std::string>& dirs,
                                                    const std::string& file_name_pattern,
                                                    const std::string& exclude_list,
                                                    const std::string& exclude_dir_list);
 
+    // FindClassInheritance with the results cached per class name.
+    static root_ext::ClassInheritance GetClassInheritance(const std::string& class_name);
+
 private:
+    // Called for each input file after its content is collected. Calls are serialized, but the order of the files
+    // is not defined if more than one thread is used.
     virtual void ProcessFile(const std::string& /*file_name*/, const std::shared_ptr<TFile>& /*file*/) {}
 
-    static void ProcessDirectory(const std::string& file_name, const std::string& dir_name, TDirectory* dir,
-                                 ObjectCollection& objects, bool process_histograms, bool process_trees);
+    void ProcessWithMemoryBudget(bool process_histograms, bool process_trees);
+    std::vector<std::set<std::string>> SplitIntoBatches() const;
+    void WriteHistograms();
+    void MergeTrees();
+    void MergeTree(const Key& key, TreeDescriptor& descriptor);
+    static bool IsFastMergePossible(const TObjArray& input_branches, const TObjArray& output_branches,
+                                    int compression_settings, std::string& reason);
+
+    static void ProcessDirectory(size_t file_index, const std::string& file_name, const std::string& dir_name,
+                                 TDirectory* dir, ObjectCollection& objects, HistogramAction hist_action,
+                                 bool process_trees, bool recursive = true);
+
+    // Run function(n) for n in [0, n_tasks) using up to n_threads threads.
+    template<typename Function>
+    void RunParallel(size_t n_tasks, Function function) const;
 
 protected:
     const std::vector<std::string> input_files;
     std::shared_ptr<TFile> output_file;
     ObjectCollection objects;
+    unsigned n_threads;
+    bool fast_tree_merge{false};
+    size_t memory_budget{0};
 };
 
 } // namespace analysis
@@ -3,24 +3,33 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 
 #pragma once
 
-#include <deque>
 #include <string>
 #include <limits>
 #include <stdexcept>
 #include <memory>
 #include <fstream>
+#include <iostream>
 #include <mutex>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <boost/optional.hpp>
 
 #include <TObject.h>
+#include <TList.h>
 #include <TH1.h>
 #include <TH2.h>
 #include <TTree.h>
 #include <TGraph.h>
+#include <TVectorD.h>
 
 #include "RootExt.h"
 #include "TextIO.h"
 #include "NumericPrimitives.h"
 #include "PropertyConfigReader.h"
+#include "HistogramBinLookup.h"
+#include "QuantileSketch.h"
+#include "ValueColumns.h"
 
 namespace root_ext {
 
@@ -34,6 +43,23 @@ public:
     virtual ~AbstractHistogram() {}
 
     virtual void WriteRootObject() = 0;
+
+    /// ROOT object that WriteRootObject stores in the output directory as is, or nullptr if there is nothing to
+    /// store or the stored object is created only at the moment of writing.
+    virtual const TObject* GetRootObject() const { return nullptr; }
+
+    /// Remove the content keeping the binning. Used to create per-thread shards of the histogram.
+    virtual void ResetContent()
+    {
+        throw analysis::exception("Histogram '%1%' doesn't support sharding.") % name;
+    }
+
+    /// Add the content of a shard created as a copy of this histogram.
+    virtual void AddShard(const AbstractHistogram& /*shard*/)
+    {
+        throw analysis::exception("Histogram '%1%' doesn't support sharding.") % name;
+    }
+
     virtual void SetOutputDirectory(TDirectory* directory) { outputDirectory = directory; }
 
     TDirectory* GetOutputDirectory() const { return outputDirectory; }
@@ -53,20 +79,36 @@ namespace detail {
 template<typename ValueType>
 class Base1DHistogram : public AbstractHistogram {
 public:
-    using const_iterator = typename std::deque<ValueType>::const_iterator;
+    using Columns = ValueColumns<ValueType, 1>;
     using RootContainer = TTree;
 
     Base1DHistogram(const std::string& name) : AbstractHistogram(name) {}
 
-    const std::deque<ValueType>& Data() const { return data; }
-    size_t size() const { return data.size(); }
-    const_iterator begin() const { return data.begin(); }
-    const_iterator end() const { return data.end(); }
+    /// Copy of all values. Should be called only when no other thread is filling the histogram.
+    std::vector<ValueType> Data() const
+    {
+        std::vector<ValueType> result;
+        result.reserve(values.size());
+        ForEach([&](const ValueType& value) { result.push_back(value); });
+        return result;
+    }
+
+    /// Call functor(value) for all values. It replaces the begin/end iteration over the former std::deque storage,
+    /// because the values can be spread over several blocks and a temporary file.
+    template<typename Function>
+    void ForEach(Function functor) const
+    {
+        values.ForEachBlock([&](const typename Columns::ColumnPointers& columns, size_t n_values) {
+            for(size_t n = 0; n < n_values; ++n)
+                functor(columns[0][n]);
+        });
+    }
+
+    size_t size() const { return values.size(); }
 
     void Fill(const ValueType& value)
     {
-        std::lock_guard<Mutex> lock(GetMutex());
-        data.push_back(value);
+        values.Append({{ value }});
     }
 
     virtual void WriteRootObject()
@@ -76,31 +118,46 @@ public:
         std::unique_ptr<TTree> rootTree(new TTree(Name().c_str(), Name().c_str()));
         rootTree->SetDirectory(GetOutputDirectory());
         ValueType branch_value;
-        rootTree->Branch("values", &branch_value);
-        for(const ValueType& value : data) {
-            branch_value = value;
-            rootTree->Fill();
-        }
+        TBranch* branch = rootTree->Branch("values", &branch_value);
+        values.ForEachBlock([&](const typename Columns::ColumnPointers& columns, size_t n_values) {
+            for(size_t n = 0; n < n_values; ++n) {
+                branch_value = columns[0][n];
+                branch->Fill();
+            }
+        });
+        rootTree->SetEntries(static_cast<Long64_t>(values.size()));
         root_ext::WriteObject(*rootTree);
     }
 
     void CopyContent(TTree& rootTree)
     {
         std::lock_guard<Mutex> lock(GetMutex());
-        data.clear();
+        values.Clear();
         ValueType branch_value;
         TBranch* branch;
         rootTree.SetBranchAddress("values", &branch_value, &branch);
         Long64_t N = rootTree.GetEntries();
         for(Long64_t n = 0; n < N; ++n) {
             rootTree.GetEntry(n);
-            data.push_back(branch_value);
+            values.Append({{ branch_value }});
         }
         rootTree.ResetBranchAddress(branch);
     }
 
+    virtual void ResetContent() override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        values.Clear();
+    }
+
+    virtual void AddShard(const AbstractHistogram& shard) override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        values.AppendAll(dynamic_cast<const Base1DHistogram<ValueType>&>(shard).values);
+    }
+
 private:
-    std::deque<ValueType> data;
+    Columns values;
 };
 
 template<typename NumberType>
@@ -112,22 +169,38 @@ public:
         Value(NumberType _x, NumberType _y) : x(_x), y(_y) {}
     };
 
-    using const_iterator = typename std::deque<Value>::const_iterator;
+    using Columns = ValueColumns<NumberType, 2>;
     using RootContainer = TTree;
 
     Base2DHistogram(const std::string& name) : AbstractHistogram(name) {}
 
-    const std::deque<Value>& Data() const { return data; }
-    size_t size() const { return data.size(); }
-    const_iterator begin() const { return data.begin(); }
-    const_iterator end() const { return data.end(); }
+    /// Copy of all values. Should be called only when no other thread is filling the histogram.
+    std::vector<Value> Data() const
+    {
+        std::vector<Value> result;
+        result.reserve(values.size());
+        ForEach([&](const Value& value) { result.push_back(value); });
+        return result;
+    }
+
+    /// Call functor(value) for all values, see Base1DHistogram::ForEach.
+    template<typename Function>
+    void ForEach(Function functor) const
+    {
+        values.ForEachBlock([&](const typename Columns::ColumnPointers& columns, size_t n_values) {
+            for(size_t n = 0; n < n_values; ++n)
+                functor(Value(columns[0][n], columns[1][n]));
+        });
+    }
+
+    size_t size() const { return values.size(); }
 
     void Fill(const NumberType& x, const NumberType& y)
     {
-        std::lock_guard<Mutex> lock(GetMutex());
-        data.push_back(Value(x, y));
+        values.Append({{ x, y }});
     }
 
+    // The branches are filled column by column directly from the blocks.
     virtual void WriteRootObject()
     {
         std::lock_guard<Mutex> lock(GetMutex());
@@ -135,20 +208,26 @@ public:
         std::unique_ptr<TTree> rootTree(new TTree(Name().c_str(), Name().c_str()));
         rootTree->SetDirectory(GetOutputDirectory());
         NumberType branch_value_x, branch_value_y;
-        rootTree->Branch("x", &branch_value_x);
-        rootTree->Branch("y", &branch_value_y);
-        for(const Value& value : data) {
-            branch_value_x = value.x;
-            branch_value_y = value.y;
-            rootTree->Fill();
-        }
+        TBranch* branch_x = rootTree->Branch("x", &branch_value_x);
+        TBranch* branch_y = rootTree->Branch("y", &branch_value_y);
+        values.ForEachBlock([&](const typename Columns::ColumnPointers& columns, size_t n_values) {
+            for(size_t n = 0; n < n_values; ++n) {
+                branch_value_x = columns[0][n];
+                branch_x->Fill();
+            }
+            for(size_t n = 0; n < n_values; ++n) {
+                branch_value_y = columns[1][n];
+                branch_y->Fill();
+            }
+        });
+        rootTree->SetEntries(static_cast<Long64_t>(values.size()));
         root_ext::WriteObject(*rootTree);
     }
 
     void CopyContent(TTree& rootTree)
     {
         std::lock_guard<Mutex> lock(GetMutex());
-        data.clear();
+        values.Clear();
         NumberType branch_value_x, branch_value_y;
         TBranch *branch_x, *branch_y;
         rootTree.SetBranchAddress("x", &branch_value_x, &branch_x);
@@ -156,14 +235,81 @@ public:
         Long64_t N = rootTree.GetEntries();
         for(Long64_t n = 0; n < N; ++n) {
             rootTree.GetEntry(n);
-            data.push_back(Value(branch_value_x, branch_value_y));
+            values.Append({{ branch_value_x, branch_value_y }});
         }
         rootTree.ResetBranchAddress(branch_x);
         rootTree.ResetBranchAddress(branch_y);
     }
 
+    virtual void ResetContent() override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        values.Clear();
+    }
+
+    virtual void AddShard(const AbstractHistogram& shard) override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        values.AppendAll(dynamic_cast<const Base2DHistogram<NumberType>&>(shard).values);
+    }
+
 private:
-    std::deque<Value> data;
+    Columns values;
+};
+
+// Values collected by a histogram before its binning is chosen. The quantile sketch sees all values and is used to
+// choose the range. The values themselves are kept while there are at most max_buffered of them, so that
+// the histogram can be filled exactly once the range is known. Otherwise only the sketch buckets are available.
+struct AutoBinningData {
+    analysis::QuantileSketch sketch;
+    std::vector<double> values, weights;
+    size_t max_buffered;
+    bool exact{true};
+
+    explicit AutoBinningData(size_t _max_buffered) : max_buffered(_max_buffered) {}
+
+    void Add(double value, double weight)
+    {
+        sketch.Add(value, weight);
+        if(!exact) return;
+        values.push_back(value);
+        weights.push_back(weight);
+        if(values.size() > max_buffered)
+            DropValues();
+    }
+
+    void Merge(const AutoBinningData& other)
+    {
+        sketch.Merge(other.sketch);
+        if(exact && other.exact && values.size() + other.values.size() <= max_buffered) {
+            values.insert(values.end(), other.values.begin(), other.values.end());
+            weights.insert(weights.end(), other.weights.begin(), other.weights.end());
+        } else
+            DropValues();
+    }
+
+    void MergeSketch(const analysis::QuantileSketch& other_sketch)
+    {
+        sketch.Merge(other_sketch);
+        if(!other_sketch.Empty())
+            DropValues();
+    }
+
+    void Clear()
+    {
+        sketch.Clear();
+        values.clear();
+        weights.clear();
+        exact = true;
+    }
+
+private:
+    void DropValues()
+    {
+        exact = false;
+        std::vector<double>().swap(values);
+        std::vector<double>().swap(weights);
+    }
 };
 
 } // namespace detail
@@ -264,11 +410,19 @@ public:
         : TH1D(other), AbstractHistogram(other.GetName()), store(false), use_log_y(_use_log_y), max_y_sf(_max_y_sf),
           divide_by_bin_width(_divide_by_bin_width) {}
 
+    /// The binning is taken from x_range or x_bins. Without them the histogram has DefaultNumberOfBins bins and
+    /// an extendable axis with the range chosen from the first DefaultBufferSize values, unless auto_binning is set.
+    /// With auto_binning the range is chosen from the full distribution when the histogram is written (see
+    /// HasAutoBinning), n_bins sets the number of bins and store_sketch stores the sketch next to the histogram.
+    /// The first auto_binning_buffer values (DefaultAutoBinningBufferSize by default) are kept to fill the histogram
+    /// exactly; above it the content is approximated from the sketch. A larger buffer costs 16 bytes per value and
+    /// per thread shard, e.g. auto_binning_buffer = 100000 takes 1.6 MB for each histogram.
     SmartHistogram(const std::string& name, const analysis::PropertyConfigReader::Item& p_config)
         : AbstractHistogram(name)
     {
         static constexpr int DefaultNumberOfBins = 100;
         static constexpr int DefaultBufferSize = 1000;
+        static constexpr size_t DefaultAutoBinningBufferSize = 1000;
         try {
             TH1D::SetName(name.c_str());
             TH1D::SetTitle(name.c_str());
@@ -284,7 +438,15 @@ public:
                     bins.push_back(analysis::Parse<double>(bin_str));
                 TH1D::SetBins(static_cast<int>(bins.size()) - 1, bins.data());
                 divide_by_bin_width = true;
-            } else{
+            } else if(p_config.Has("auto_binning") && p_config.Get<bool>("auto_binning")) {
+                auto_binning_n_bins = DefaultNumberOfBins;
+                size_t max_buffered = DefaultAutoBinningBufferSize;
+                p_config.Read("n_bins", auto_binning_n_bins);
+                p_config.Read("auto_binning_buffer", max_buffered);
+                p_config.Read("store_sketch", store_sketch);
+                TH1D::SetBins(auto_binning_n_bins, 0, 1);
+                auto_binning = detail::AutoBinningData(max_buffered);
+            } else {
                 SetBins(DefaultNumberOfBins, 0, 0);
                 GetXaxis()->SetCanExtend(true);
                 SetBuffer(DefaultBufferSize);
@@ -308,6 +470,46 @@ public:
         }
     }
 
+    using TH1D::Fill;
+
+    /// In the auto-binning mode Fill returns -1, because the bin is not known before the binning is chosen.
+    virtual Int_t Fill(Double_t x) override
+    {
+        if(!auto_binning)
+            return TH1D::Fill(x);
+        auto_binning->Add(x, 1);
+        return -1;
+    }
+
+    virtual Int_t Fill(Double_t x, Double_t w) override
+    {
+        if(!auto_binning)
+            return TH1D::Fill(x, w);
+        auto_binning->Add(x, w);
+        return -1;
+    }
+
+    using TH1D::FillN;
+
+    /// Same result as TH1D::FillN, including the statistics and the value at the upper edge of the axis that goes
+    /// to the overflow bin.
+    virtual void FillN(Int_t ntimes, const Double_t* x, const Double_t* w, Int_t stride = 1) override
+    {
+        FillValues(ntimes, x, w, stride, detail::UpperEdgeBin::Overflow);
+    }
+
+    /// Fill a batch of values. If weights are empty, all weights are 1. The value at the upper edge of the axis is
+    /// counted in the last bin, as RangeWithStep::find_bin does, while Fill counts it in the overflow bin.
+    /// For a histogram with the buffer or an extendable axis, the batch is passed to TH1D::FillN as is.
+    void FillN(const std::vector<double>& values, const std::vector<double>& weights = {})
+    {
+        if(!weights.empty() && weights.size() != values.size())
+            throw analysis::exception("FillN for histogram '%1%': number of weights %2% != number of values %3%.")
+                % Name() % weights.size() % values.size();
+        FillValues(static_cast<Int_t>(values.size()), values.data(), weights.empty() ? nullptr : weights.data(), 1,
+                   detail::UpperEdgeBin::LastBin);
+    }
+
     virtual void SetName(const char* _name) override
     {
         std::lock_guard<Mutex> lock(GetMutex());
@@ -325,8 +527,143 @@ public:
     virtual void WriteRootObject() override
     {
         std::lock_guard<Mutex> lock(GetMutex());
-        if(store && GetOutputDirectory())
-            root_ext::WriteObject(*this);
+        if(!store || !GetOutputDirectory()) return;
+        if(auto_binning && store_sketch) {
+            const auto sketch = auto_binning->sketch.Serialize();
+            const TVectorD sketch_vector(static_cast<Int_t>(sketch.size()), sketch.data());
+            root_ext::WriteObject(sketch_vector, GetOutputDirectory(), SketchName(Name()));
+        }
+        ApplyAutoBinning();
+        root_ext::WriteObject(*this);
+    }
+
+    // In the auto-binning mode the histogram content is known only at the moment of writing.
+    virtual const TObject* GetRootObject() const override
+    {
+        return store && GetOutputDirectory() && !auto_binning ? this : nullptr;
+    }
+
+    virtual void ResetContent() override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        Reset();
+        if(auto_binning)
+            auto_binning->Clear();
+    }
+
+    // Merge is used instead of Add to support the shards with the axes extended independently.
+    virtual void AddShard(const AbstractHistogram& shard) override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        const auto& other = dynamic_cast<const SmartHistogram<TH1D>&>(shard);
+        if(auto_binning && other.auto_binning) {
+            auto_binning->Merge(*other.auto_binning);
+            return;
+        }
+        ApplyAutoBinning();
+        if(other.auto_binning) {
+            AddShard(WithAutoBinningApplied(other));
+            return;
+        }
+        TList list;
+        list.Add(const_cast<SmartHistogram<TH1D>*>(&other));
+        Merge(&list);
+    }
+
+    /// In the auto-binning mode the values are collected by a quantile sketch, and the range and bins are chosen
+    /// from the full distribution when the histogram is written. The sketches are merged across threads by
+    /// AddShard and AddHistogram, and can be stored next to the histogram to be merged across jobs.
+    /// Until ApplyAutoBinning is called (WriteRootObject calls it), the histogram is empty: Integral, GetMean
+    /// and the other TH1 methods do not see the filled values.
+    bool HasAutoBinning() const { return static_cast<bool>(auto_binning); }
+    const analysis::QuantileSketch* GetAutoBinningSketch() const
+    {
+        return auto_binning ? &auto_binning->sketch : nullptr;
+    }
+    /// False if the exact values are no longer available and the content will be approximated from the sketch.
+    bool IsAutoBinningExact() const { return !auto_binning || auto_binning->exact; }
+    static std::string SketchName(const std::string& hist_name) { return hist_name + "_sketch"; }
+
+    static analysis::QuantileSketch ReadSketch(TDirectory& dir, const std::string& hist_name)
+    {
+        std::unique_ptr<TVectorD> sketch_vector(root_ext::ReadObject<TVectorD>(dir, SketchName(hist_name)));
+        const Double_t* data = sketch_vector->GetMatrixArray();
+        return analysis::QuantileSketch::Deserialize(
+                    analysis::QuantileSketch::Serialized(data, data + sketch_vector->GetNrows()));
+    }
+
+    void MergeAutoBinningSketch(const analysis::QuantileSketch& sketch)
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        if(!auto_binning)
+            throw analysis::exception("Histogram '%1%' is not in the auto-binning mode.") % Name();
+        auto_binning->MergeSketch(sketch);
+    }
+
+    /// Choose the range from the sketch quantiles and fill the histogram. Values outside of the central 99.8% of
+    /// the distribution can end up in the underflow and overflow bins. If the exact values are available, the
+    /// result is the same as if they were filled directly into the histogram with this range. Otherwise,
+    /// the content of each sketch bucket is split between the bins proportionally to their overlap with the bucket,
+    /// and the bins are made at least as wide as the buckets, so the number of bins can be smaller than requested.
+    void ApplyAutoBinning()
+    {
+        static constexpr double tail_fraction = 0.001, margin_fraction = 0.05, single_value_margin = 0.01;
+        std::lock_guard<Mutex> lock(GetMutex());
+        if(!auto_binning) return;
+        const detail::AutoBinningData data = std::move(*auto_binning);
+        auto_binning = boost::none;
+        const analysis::QuantileSketch& sketch = data.sketch;
+
+        double low = 0, high = 1;
+        if(!sketch.Empty() && std::isfinite(sketch.GetMinValue())) {
+            low = sketch.Quantile(tail_fraction);
+            high = sketch.Quantile(1 - tail_fraction);
+            if(!(high > low)) {
+                low = sketch.GetMinValue();
+                high = sketch.GetMaxValue();
+            }
+            const double margin = high > low ? (high - low) * margin_fraction
+                                             : (low != 0 ? std::abs(low) * single_value_margin : 1);
+            low -= margin;
+            high += margin;
+        }
+
+        if(data.exact) {
+            TH1D::SetBins(auto_binning_n_bins, low, high);
+            for(size_t n = 0; n < data.values.size(); ++n)
+                TH1D::Fill(data.values[n], data.weights[n]);
+            return;
+        }
+
+        const double min_bin_width = std::max(std::abs(low), std::abs(high))
+                / std::ldexp(1., static_cast<int>(sketch.GetPrecisionBits()));
+        const int n_bins = static_cast<int>(std::max(1., std::min<double>(auto_binning_n_bins,
+                                                                           std::floor((high - low) / min_bin_width))));
+        std::cerr << "WARNING: histogram '" << Name() << "': more than " << data.max_buffered
+                  << " values were filled, so the content is approximated from the quantile sketch with "
+                  << n_bins << " bins of width " << (high - low) / n_bins << "." << std::endl;
+        TH1D::SetBins(n_bins, low, high);
+        if(!GetSumw2N())
+            Sumw2();
+        TArrayD& sum_w2 = *GetSumw2();
+        for(const auto& bucket : sketch.GetBuckets()) {
+            const auto edges = sketch.BucketEdges(bucket.first);
+            const Int_t first_bin = GetXaxis()->FindFixBin(edges.first);
+            const Int_t last_bin = GetXaxis()->FindFixBin(edges.second);
+            for(Int_t bin = first_bin; bin <= last_bin; ++bin) {
+                double fraction = 1;
+                if(first_bin != last_bin) {
+                    const double bin_low = bin > 0 ? GetXaxis()->GetBinLowEdge(bin) : edges.first;
+                    const double bin_high = bin <= n_bins ? GetXaxis()->GetBinUpEdge(bin) : edges.second;
+                    fraction = (std::min(edges.second, bin_high) - std::max(edges.first, bin_low))
+                            / (edges.second - edges.first);
+                }
+                AddBinContent(bin, fraction * bucket.second.sum_w);
+                sum_w2[bin] += fraction * bucket.second.sum_w2;
+            }
+        }
+        ResetStats();
+        SetEntries(static_cast<Double_t>(sketch.GetEntries()));
     }
 
     virtual void SetOutputDirectory(TDirectory* directory) override
@@ -372,6 +709,14 @@ public:
     void CopyContent(const TH1& other)
     {
         std::lock_guard<Mutex> lock(GetMutex());
+        if(auto_binning) {
+            auto_binning = boost::none;
+            const TArrayD* bins = other.GetXaxis()->GetXbins();
+            if(bins->GetSize())
+                TH1D::SetBins(other.GetNbinsX(), bins->GetArray());
+            else
+                TH1D::SetBins(other.GetNbinsX(), other.GetXaxis()->GetXmin(), other.GetXaxis()->GetXmax());
+        }
         if(other.GetNbinsX() != GetNbinsX())
             throw analysis::exception("Unable to copy histogram content: source and destination have different number"
                                       " of bins.");
@@ -390,6 +735,15 @@ public:
     void AddHistogram(const SmartHistogram<TH1D>& other)
     {
         std::lock_guard<Mutex> lock(GetMutex());
+        if(auto_binning && other.auto_binning) {
+            auto_binning->Merge(*other.auto_binning);
+            return;
+        }
+        ApplyAutoBinning();
+        if(other.auto_binning) {
+            AddHistogram(WithAutoBinningApplied(other));
+            return;
+        }
         const double integral = Integral(), other_integral = other.Integral(), tot_integral = integral + other_integral;
         const double post_integral = postfit_sf * integral, other_post_integral = other.postfit_sf * other_integral,
                      tot_post_integral = post_integral + other_post_integral;
@@ -400,6 +754,54 @@ public:
         Add(&other, 1);
     }
 
+private:
+    void FillValues(Int_t ntimes, const Double_t* x, const Double_t* w, Int_t stride, detail::UpperEdgeBin upper_edge)
+    {
+        if(auto_binning) {
+            for(Int_t n = 0; n < ntimes; n += stride)
+                auto_binning->Add(x[n], w ? w[n] : 1.);
+        } else if(stride != 1 || fBuffer || GetXaxis()->CanExtend() || GetStatOverflowsBehaviour()) {
+            TH1D::FillN(ntimes, x, w, stride);
+        } else if(ntimes > 0) {
+            FillBatch(static_cast<size_t>(ntimes), x, w, upper_edge);
+        }
+    }
+
+    // The bins of a chunk of values are found first, and then the contents and statistics are accumulated.
+    void FillBatch(size_t n_values, const double* values, const double* weights, detail::UpperEdgeBin upper_edge)
+    {
+        if(weights && !GetSumw2N() && !TestBit(TH1::kIsNotW)
+                && std::any_of(weights, weights + n_values, [](double w) { return w != 1; }))
+            Sumw2();
+        const detail::AxisBinLookup x_lookup(*GetXaxis(), upper_edge);
+        double* sum_w2 = GetSumw2N() ? GetSumw2()->GetArray() : nullptr;
+        std::array<Int_t, detail::FillChunkSize> bins;
+        for(size_t offset = 0; offset < n_values; offset += detail::FillChunkSize) {
+            const size_t n_chunk = std::min(detail::FillChunkSize, n_values - offset);
+            const double* x = values + offset;
+            const double* w = weights ? weights + offset : nullptr;
+            x_lookup.FindBins(n_chunk, x, bins.data());
+            detail::AccumulateBinContents(n_chunk, bins.data(), w, fArray, sum_w2);
+            for(size_t n = 0; n < n_chunk; ++n) {
+                if(!x_lookup.IsInRange(bins[n])) continue;
+                const double w_n = w ? w[n] : 1.;
+                fTsumw += w_n;
+                fTsumw2 += w_n * w_n;
+                fTsumwx += w_n * x[n];
+                fTsumwx2 += w_n * x[n] * x[n];
+            }
+        }
+        fEntries += n_values;
+    }
+
+    static SmartHistogram<TH1D> WithAutoBinningApplied(const SmartHistogram<TH1D>& other)
+    {
+        SmartHistogram<TH1D> copy(other);
+        copy.SetOutputDirectory(nullptr);
+        copy.ApplyAutoBinning();
+        return copy;
+    }
+
 private:
     bool store{true};
     bool use_log_x{false}, use_log_y{false};
@@ -409,6 +811,9 @@ private:
     std::string legend_title;
     MultiRange blind_ranges;
     double syst_unc{0}, postfit_sf{1};
+    boost::optional<detail::AutoBinningData> auto_binning;
+    int auto_binning_n_bins{0};
+    bool store_sketch{false};
 };
 
 template<>
@@ -437,6 +842,30 @@ public:
                static_cast<int>(binsy.size()) - 1, binsy.data()), AbstractHistogram(name),
           store(true), use_log_y(false), max_y_sf(1) {}
 
+    using TH2D::FillN;
+
+    /// Same result as TH2D::FillN, including the statistics and the values at the upper edges of the axes that go
+    /// to the overflow bins.
+    virtual void FillN(Int_t ntimes, const Double_t* x, const Double_t* y, const Double_t* w,
+                       Int_t stride = 1) override
+    {
+        FillValues(ntimes, x, y, w, stride, detail::UpperEdgeBin::Overflow);
+    }
+
+    /// Fill a batch of (x, y) pairs. If weights are empty, all weights are 1. The values at the upper edges of
+    /// the axes are counted in the last bins, as RangeWithStep::find_bin does.
+    /// For a histogram with the buffer or an extendable axis, the batch is passed to TH2D::FillN as is.
+    void FillN(const std::vector<double>& x_values, const std::vector<double>& y_values,
+               const std::vector<double>& weights = {})
+    {
+        if(y_values.size() != x_values.size() || (!weights.empty() && weights.size() != x_values.size()))
+            throw analysis::exception("FillN for histogram '%1%': inconsistent number of x values %2%,"
+                                      " y values %3% and weights %4%.")
+                % Name() % x_values.size() % y_values.size() % weights.size();
+        FillValues(static_cast<Int_t>(x_values.size()), x_values.data(), y_values.data(),
+                   weights.empty() ? nullptr : weights.data(), 1, detail::UpperEdgeBin::LastBin);
+    }
+
     virtual void WriteRootObject() override
     {
         std::lock_guard<Mutex> lock(GetMutex());
@@ -444,6 +873,26 @@ public:
             root_ext::WriteObject(*this);
     }
 
+    virtual const TObject* GetRootObject() const override
+    {
+        return store && GetOutputDirectory() ? this : nullptr;
+    }
+
+    virtual void ResetContent() override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        Reset();
+    }
+
+    // Merge is used instead of Add to support the shards with the axes extended independently.
+    virtual void AddShard(const AbstractHistogram& shard) override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        TList list;
+        list.Add(const_cast<SmartHistogram<TH2D>*>(&dynamic_cast<const SmartHistogram<TH2D>&>(shard)));
+        Merge(&list);
+    }
+
     virtual void SetName(const char* _name) override
     {
         std::lock_guard<Mutex> lock(GetMutex());
@@ -491,6 +940,52 @@ public:
         }
     }
 
+private:
+    void FillValues(Int_t ntimes, const Double_t* x, const Double_t* y, const Double_t* w, Int_t stride,
+                    detail::UpperEdgeBin upper_edge)
+    {
+        if(stride != 1 || fBuffer || GetXaxis()->CanExtend() || GetYaxis()->CanExtend()
+                || GetStatOverflowsBehaviour())
+            TH2D::FillN(ntimes, x, y, w, stride);
+        else if(ntimes > 0)
+            FillBatch(static_cast<size_t>(ntimes), x, y, w, upper_edge);
+    }
+
+    void FillBatch(size_t n_values, const double* x_values, const double* y_values, const double* weights,
+                   detail::UpperEdgeBin upper_edge)
+    {
+        if(weights && !GetSumw2N() && !TestBit(TH1::kIsNotW)
+                && std::any_of(weights, weights + n_values, [](double w) { return w != 1; }))
+            Sumw2();
+        const detail::AxisBinLookup x_lookup(*GetXaxis(), upper_edge), y_lookup(*GetYaxis(), upper_edge);
+        const Int_t n_x_cells = GetNbinsX() + 2;
+        double* sum_w2 = GetSumw2N() ? GetSumw2()->GetArray() : nullptr;
+        std::array<Int_t, detail::FillChunkSize> x_bins, y_bins;
+        for(size_t offset = 0; offset < n_values; offset += detail::FillChunkSize) {
+            const size_t n_chunk = std::min(detail::FillChunkSize, n_values - offset);
+            const double* x = x_values + offset;
+            const double* y = y_values + offset;
+            const double* w = weights ? weights + offset : nullptr;
+            x_lookup.FindBins(n_chunk, x, x_bins.data());
+            y_lookup.FindBins(n_chunk, y, y_bins.data());
+            for(size_t n = 0; n < n_chunk; ++n) {
+                if(!x_lookup.IsInRange(x_bins[n]) || !y_lookup.IsInRange(y_bins[n])) continue;
+                const double w_n = w ? w[n] : 1.;
+                fTsumw += w_n;
+                fTsumw2 += w_n * w_n;
+                fTsumwx += w_n * x[n];
+                fTsumwx2 += w_n * x[n] * x[n];
+                fTsumwy += w_n * y[n];
+                fTsumwy2 += w_n * y[n] * y[n];
+                fTsumwxy += w_n * x[n] * y[n];
+            }
+            for(size_t n = 0; n < n_chunk; ++n)
+                x_bins[n] += n_x_cells * y_bins[n];
+            detail::AccumulateBinContents(n_chunk, x_bins.data(), w, fArray, sum_w2);
+        }
+        fEntries += n_values;
+    }
+
 private:
     bool store;
     bool use_log_y;
@@ -522,6 +1017,21 @@ public:
             root_ext::WriteObject(*graph, GetOutputDirectory(), Name());
     }
 
+    virtual void ResetContent() override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        x_vector.clear();
+        y_vector.clear();
+    }
+
+    virtual void AddShard(const AbstractHistogram& shard) override
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        const auto& other = dynamic_cast<const SmartHistogram<TGraph>&>(shard);
+        x_vector.insert(x_vector.end(), other.x_vector.begin(), other.x_vector.end());
+        y_vector.insert(y_vector.end(), other.y_vector.begin(), other.y_vector.end());
+    }
+
 private:
     DataVector x_vector, y_vector;
 };
@@ -4,24 +4,53 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <initializer_list>
 #include <iostream>
+#include <map>
 #include <set>
 #include <stdexcept>
 #include <sstream>
 #include <memory>
 #include <mutex>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <TFile.h>
 #include <TTree.h>
+#include <TBufferFile.h>
 #include <Rtypes.h>
+#include <Compression.h>
 
-#define DECLARE_BRANCH_VARIABLE(type, name) type name;
+#include "SmartTreeReadProfiler.h"
+
+// Besides the member itself, each branch variable defines an entry of the static branch table of the data class,
+// indexed in the declaration order.
+#define DECLARE_BRANCH_VARIABLE(type, name) \
+    type name; \
+    template<typename Dummy> \
+    struct BranchInfo<__COUNTER__ - branch_counter_begin - 1, Dummy> { \
+        static constexpr const char* Name() { return #name; } \
+        template<typename Data> static auto& Get(Data& data) { return data.name; } \
+    }; \
+    /**/
 #define ADD_DATA_TREE_BRANCH(name) AddBranch(#name, _data->name);
+// Access a branch of the tree through the compile-time branch table, so that it can be tracked.
+#define GET_TREE_BRANCH(tree, name) \
+    (tree).template get<std::remove_reference_t<decltype(tree)>::BranchIndex(#name)>()
 
 #define DECLARE_TREE(namespace_name, data_class_name, tree_class_name, data_macro, tree_name) \
     namespace namespace_name { \
-    struct data_class_name : public root_ext::detail::BaseDataClass { data_macro() }; \
+    struct data_class_name : public root_ext::detail::BaseDataClass { \
+        template<size_t index, typename Dummy = void> struct BranchInfo; \
+        static constexpr size_t branch_counter_begin = __COUNTER__; \
+        data_macro() \
+        static constexpr size_t BranchCount = __COUNTER__ - branch_counter_begin - 1; \
+    }; \
     using data_class_name##Vector = std::vector< data_class_name >; \
     class tree_class_name : public root_ext::detail::BaseSmartTree<data_class_name> { \
     public: \
@@ -33,6 +62,24 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
                         const std::set<std::string>& disabled_branches = {}, \
                         const std::set<std::string>& enabled_branches = {}) \
             : BaseSmartTree(name, directory, readMode, disabled_branches,enabled_branches) { Initialize(); } \
+        tree_class_name(TDirectory* directory, const root_ext::SmartTreeReadOptions& read_options, \
+                        const std::set<std::string>& disabled_branches = {}, \
+                        const std::set<std::string>& enabled_branches = {}) \
+            : BaseSmartTree(Name(), directory, read_options, disabled_branches, enabled_branches) { Initialize(); } \
+        tree_class_name(const std::string& name, TDirectory* directory, \
+                        const root_ext::SmartTreeReadOptions& read_options, \
+                        const std::set<std::string>& disabled_branches = {}, \
+                        const std::set<std::string>& enabled_branches = {}) \
+            : BaseSmartTree(name, directory, read_options, disabled_branches, enabled_branches) { Initialize(); } \
+        tree_class_name(TDirectory* directory, const root_ext::SmartTreeWriteProfile& write_profile, \
+                        const std::set<std::string>& disabled_branches = {}, \
+                        const std::set<std::string>& enabled_branches = {}) \
+            : BaseSmartTree(Name(), directory, write_profile, disabled_branches, enabled_branches) { Initialize(); } \
+        tree_class_name(const std::string& name, TDirectory* directory, \
+                        const root_ext::SmartTreeWriteProfile& write_profile, \
+                        const std::set<std::string>& disabled_branches = {}, \
+                        const std::set<std::string>& enabled_branches = {}) \
+            : BaseSmartTree(name, directory, write_profile, disabled_branches, enabled_branches) { Initialize(); } \
     private: \
         inline void Initialize(); \
     }; \
@@ -43,6 +90,8 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
     namespace namespace_name { \
         inline void tree_class_name::Initialize() { \
             data_macro() \
+            InitializeBranchTable(); \
+            ApplyReadOptions(); \
             if (GetEntries() > 0) GetEntry(0); \
         } \
     } \
@@ -55,9 +104,18 @@ template<typename type>
 using intmap = std::map<uint32_t, type>;
 
 namespace detail {
+    struct BaseBulkColumn {
+        virtual ~BaseBulkColumn() {}
+        virtual void Read(TBranch& branch, Long64_t first_entry, Long64_t n_entries) = 0;
+    };
+
+    template<typename DataType>
+    struct BulkColumn;
+
     struct BaseSmartTreeEntry {
         virtual ~BaseSmartTreeEntry() {}
         virtual void clear() {}
+        virtual std::shared_ptr<BaseBulkColumn> CreateBulkColumn() const = 0;
     };
 
     template<typename DataType>
@@ -65,6 +123,11 @@ namespace detail {
         DataType* value;
         SmartTreePtrEntry(DataType& origin)
             : value(&origin) {}
+
+        virtual std::shared_ptr<BaseBulkColumn> CreateBulkColumn() const override
+        {
+            return std::make_shared<BulkColumn<DataType>>(value);
+        }
     };
 
     template<typename DataType>
@@ -84,6 +147,148 @@ namespace detail {
         using PtrEntry = SmartTreeCollectionEntry<std::map<KeyType, DataType>>;
     };
 
+    // Fundamental types are read basket by basket through the ROOT bulk API, when the branch layout allows it.
+    // All other types are read entry by entry into the tree-bound object and copied into the column.
+    template<typename DataType, bool is_arithmetic = std::is_arithmetic<DataType>::value>
+    struct BulkReader {
+        static void Read(TBranch& branch, Long64_t first_entry, Long64_t n_entries, const DataType* value,
+                         std::vector<DataType>& values)
+        {
+            for(Long64_t n = first_entry; n < first_entry + n_entries; ++n) {
+                if(branch.GetEntry(n) < 0)
+                    throw std::runtime_error("SmartTree: an I/O error occured while reading branch '"
+                                             + std::string(branch.GetName()) + "'.");
+                values.push_back(*value);
+            }
+        }
+    };
+
+    template<typename DataType>
+    struct BulkReader<DataType, true> {
+        static void Read(TBranch& branch, Long64_t first_entry, Long64_t n_entries, const DataType* value,
+                         std::vector<DataType>& values)
+        {
+            static constexpr Int_t initialBufferSize = 32 * 1024;
+            if(!branch.SupportsBulkRead()) {
+                BulkReader<DataType, false>::Read(branch, first_entry, n_entries, value, values);
+                return;
+            }
+            TBufferFile buffer(TBuffer::kWrite, initialBufferSize);
+            const Long64_t last_entry = first_entry + n_entries;
+            for(Long64_t entry = first_entry; entry < last_entry;) {
+                // GetBulkEntries accepts only the first entry of a basket and returns the whole basket.
+                const Long64_t basket_first = FindBasketFirstEntry(branch, entry);
+                const Int_t n_read = branch.GetBulkRead().GetBulkEntries(basket_first, buffer);
+                const Long64_t n_skip = entry - basket_first;
+                if(n_read <= n_skip)
+                    throw std::runtime_error("SmartTree: bulk read of branch '" + std::string(branch.GetName())
+                                             + "' has failed.");
+                const Long64_t n_used = std::min<Long64_t>(n_read - n_skip, last_entry - entry);
+                const DataType* begin = reinterpret_cast<const DataType*>(buffer.GetCurrent()) + n_skip;
+                values.insert(values.end(), begin, begin + n_used);
+                entry += n_used;
+            }
+        }
+
+    private:
+        static Long64_t FindBasketFirstEntry(TBranch& branch, Long64_t entry)
+        {
+            // The entry boundaries of the baskets written to the file are followed by the first entry of
+            // the basket that is still in memory.
+            const Long64_t* basket_entries = branch.GetBasketEntry();
+            const Long64_t* basket_entries_end = basket_entries + branch.GetWriteBasket() + 1;
+            const Long64_t* basket = std::upper_bound(basket_entries, basket_entries_end, entry);
+            return basket == basket_entries ? entry : *(basket - 1);
+        }
+    };
+
+    template<typename DataType>
+    struct BulkColumn : BaseBulkColumn {
+        using ValueType = DataType;
+        using const_iterator = typename std::vector<DataType>::const_iterator;
+
+        BulkColumn(const DataType* _value) : value(_value) {}
+
+        virtual void Read(TBranch& branch, Long64_t first_entry, Long64_t n_entries) override
+        {
+            values.clear();
+            values.reserve(static_cast<size_t>(n_entries));
+            BulkReader<DataType>::Read(branch, first_entry, n_entries, value, values);
+        }
+
+        const std::vector<DataType>& Values() const { return values; }
+        const DataType& operator[](size_t n) const { return values[n]; }
+        size_t size() const { return values.size(); }
+        const_iterator begin() const { return values.begin(); }
+        const_iterator end() const { return values.end(); }
+
+    private:
+        const DataType* value;
+        std::vector<DataType> values;
+    };
+
+    template<typename ValueType>
+    struct BulkColumn<std::vector<ValueType>> : BaseBulkColumn {
+        using DataType = std::vector<ValueType>;
+        using const_iterator = typename std::vector<ValueType>::const_iterator;
+
+        BulkColumn(const DataType* _value) : value(_value) {}
+
+        virtual void Read(TBranch& branch, Long64_t first_entry, Long64_t n_entries) override
+        {
+            values.clear();
+            offsets.assign(1, 0);
+            offsets.reserve(static_cast<size_t>(n_entries) + 1);
+            for(Long64_t n = first_entry; n < first_entry + n_entries; ++n) {
+                if(branch.GetEntry(n) < 0)
+                    throw std::runtime_error("SmartTree: an I/O error occured while reading branch '"
+                                             + std::string(branch.GetName()) + "'.");
+                values.insert(values.end(), value->begin(), value->end());
+                offsets.push_back(values.size());
+            }
+        }
+
+        const std::vector<ValueType>& Values() const { return values; }
+        const std::vector<size_t>& Offsets() const { return offsets; }
+        size_t size() const { return offsets.size() - 1; }
+        size_t size(size_t n) const { return offsets.at(n + 1) - offsets.at(n); }
+        const_iterator begin(size_t n) const { return values.begin() + static_cast<std::ptrdiff_t>(offsets.at(n)); }
+        const_iterator end(size_t n) const { return values.begin() + static_cast<std::ptrdiff_t>(offsets.at(n + 1)); }
+
+    private:
+        const DataType* value;
+        std::vector<ValueType> values;
+        std::vector<size_t> offsets{0};
+    };
+
+    template<typename DataType>
+    struct BranchCleaner { static void clear(DataType&) {} };
+    template<typename DataType>
+    struct BranchCleaner<std::vector<DataType>> { static void clear(std::vector<DataType>& value) { value.clear(); } };
+    template<typename KeyType, typename DataType>
+    struct BranchCleaner<std::map<KeyType, DataType>> {
+        static void clear(std::map<KeyType, DataType>& value) { value.clear(); }
+    };
+
+    constexpr bool ConstexprStrEqual(const char* a, const char* b)
+    {
+        return *a == *b && (*a == '\0' || ConstexprStrEqual(a + 1, b + 1));
+    }
+
+    template<typename Data, size_t index = 0, bool is_end = (index >= Data::BranchCount)>
+    struct BranchIndexFinder {
+        static constexpr size_t Find(const char* branch_name)
+        {
+            return ConstexprStrEqual(Data::template BranchInfo<index>::Name(), branch_name)
+                    ? index : BranchIndexFinder<Data, index + 1>::Find(branch_name);
+        }
+    };
+
+    template<typename Data, size_t index>
+    struct BranchIndexFinder<Data, index, true> {
+        static constexpr size_t Find(const char*) { return index; }
+    };
+
     struct BaseDataClass {
         BaseDataClass() {}
         BaseDataClass(const BaseDataClass&) {}
@@ -115,7 +320,7 @@ namespace detail {
     template<typename DataType>
     struct BranchCreator {
         void Create(TTree& tree, const std::string& branch_name, DataType& value, bool readMode,
-                    SmartTreeEntryMap& entries)
+                    SmartTreeEntryMap& entries, Int_t bufferSize = 32 * 1024)
         {
             using FixesMap = std::unordered_map<std::string, std::string>;
 
@@ -162,7 +367,6 @@ namespace detail {
                 }
             } else {
 
-                static constexpr Int_t bufferSize = 32 * 1024;
                 TBranch* branch;
                 if(cl) {
                     std::string cl_name = cl->GetName();
@@ -181,6 +385,135 @@ namespace detail {
 
 } // detail
 
+class SmartTreeBulkBlock {
+public:
+    using ColumnMap = std::unordered_map<std::string, std::shared_ptr<detail::BaseBulkColumn>>;
+
+    Long64_t FirstEntry() const { return first_entry; }
+    Long64_t GetEntries() const { return n_entries; }
+    size_t size() const { return static_cast<size_t>(n_entries); }
+    bool HasColumn(const std::string& branch_name) const { return columns.count(branch_name) != 0; }
+
+    template<typename T>
+    const detail::BulkColumn<T>& Get(const std::string& branch_name) const
+    {
+        auto iter = columns.find(branch_name);
+        if(iter == columns.end())
+            throw std::runtime_error("Column '" + branch_name + "' is not part of the bulk block.");
+        auto column = dynamic_cast<const detail::BulkColumn<T>*>(iter->second.get());
+        if(!column)
+            throw std::runtime_error("Invalid type for column '" + branch_name + "'.");
+        return *column;
+    }
+
+private:
+    friend class SmartTree;
+
+    Long64_t first_entry{0}, n_entries{0};
+    ColumnMap columns;
+};
+
+namespace detail {
+    inline bool WildcardMatch(const char* pattern, const char* str)
+    {
+        if(*pattern == '\0') return *str == '\0';
+        if(*pattern == '*')
+            return WildcardMatch(pattern + 1, str) || (*str != '\0' && WildcardMatch(pattern, str + 1));
+        if(*str != '\0' && (*pattern == '?' || *pattern == *str))
+            return WildcardMatch(pattern + 1, str + 1);
+        return false;
+    }
+} // detail
+
+/// Basket and compression settings for a tree in the write mode. Branch rules are matched using wildcard
+/// patterns ('*' and '?'); when several rules match the same branch, the rules added later take precedence.
+struct SmartTreeWriteProfile {
+    struct BranchSettings {
+        Int_t basket_size{0}; ///< 0 - use the default basket size
+        Int_t compression_settings{-1}; ///< -1 - inherit the compression settings from the output file
+    };
+
+    struct BranchRule {
+        std::string pattern;
+        BranchSettings settings;
+    };
+
+    Int_t default_basket_size{32 * 1024};
+    Long64_t auto_flush{- 50 * 1024 * 1024};
+    Long64_t max_virtual_size{200 * 1024 * 1024};
+    /// TTree::Fill already resizes the baskets when the first cluster is flushed, using the size of the cluster as
+    /// the memory limit. If set, the baskets are resized once more with optimize_max_memory as the limit.
+    bool optimize_baskets{false};
+    ULong64_t optimize_max_memory{10 * 1024 * 1024}; ///< total memory for the baskets of all branches
+    std::vector<BranchRule> rules;
+
+    SmartTreeWriteProfile& SetBasketSize(const std::string& pattern, Int_t basket_size)
+    {
+        BranchRule rule;
+        rule.pattern = pattern;
+        rule.settings.basket_size = basket_size;
+        rules.push_back(rule);
+        return *this;
+    }
+
+    SmartTreeWriteProfile& SetCompression(const std::string& pattern, ROOT::ECompressionAlgorithm algorithm,
+                                          int level)
+    {
+        BranchRule rule;
+        rule.pattern = pattern;
+        rule.settings.compression_settings = ROOT::CompressionSettings(algorithm, level);
+        rules.push_back(rule);
+        return *this;
+    }
+
+    BranchSettings GetBranchSettings(const std::string& branch_name) const
+    {
+        BranchSettings result;
+        result.basket_size = default_basket_size;
+        for(const auto& rule : rules) {
+            if(!detail::WildcardMatch(rule.pattern.c_str(), branch_name.c_str())) continue;
+            if(rule.settings.basket_size > 0)
+                result.basket_size = rule.settings.basket_size;
+            if(rule.settings.compression_settings >= 0)
+                result.compression_settings = rule.settings.compression_settings;
+        }
+        return result;
+    }
+
+    bool HasExplicitBasketSize(const std::string& branch_name) const
+    {
+        for(const auto& rule : rules) {
+            if(rule.settings.basket_size > 0 && detail::WildcardMatch(rule.pattern.c_str(), branch_name.c_str()))
+                return true;
+        }
+        return false;
+    }
+};
+
+struct SmartTreeReadOptions {
+    bool use_cache{true};
+    Long64_t cache_size{0}; ///< if <= 0, the cache size is derived from the bytes per cluster of the active branches
+    double n_clusters_in_cache{1.2};
+    Long64_t min_cache_size{1024 * 1024}, max_cache_size{1024 * 1024 * 1024};
+    bool parallel_unzip{false};
+    /// Branches that are missing in the input tree are written into a new entry-aligned friend tree
+    /// (see SmartTree::FillDerived). The directory should be writable.
+    bool derived_columns{false};
+    /// Read the active branches one by one and collect the per-branch I/O costs (see SmartTreeReadProfiler).
+    /// The report is written when the tree is destroyed into profile_report file or, if it is empty, to std::cout.
+    bool profile_read{false};
+    std::string profile_report;
+    /// Record which branches are accessed by the user code through BaseSmartTree::get and write them into
+    /// access_whitelist file when the tree is destroyed. The file can be loaded with SmartTree::LoadBranchList
+    /// and used as enabled_branches in the later runs.
+    /// Only the accessors are tracked: GET_TREE_BRANCH(tree, pt) or tree.get<double>("pt") instead of tree().pt.
+    /// Any use of tree(), data() or the entry iterators marks the access as untracked, and then the whitelist is not
+    /// written, because the branches read this way are not known. This is the case for the existing code that reads
+    /// the data struct directly and for ParallelForEach, which passes the data struct to the functor.
+    bool track_access{false};
+    std::string access_whitelist;
+};
+
 class SmartTree {
 public:
     using Mutex = std::recursive_mutex;
@@ -200,6 +533,7 @@ public:
             tree = dynamic_cast<TTree*>(directory->Get(name.c_str()));
             if(!tree)
                 throw std::runtime_error("Tree not found.");
+            AttachDerivedTrees();
             if(tree->GetNbranches())
                 tree->SetBranchStatus("*", 0);
         } else {
@@ -212,15 +546,76 @@ public:
             }
         }
     }
+    SmartTree(const std::string& _name, TDirectory* _directory, const SmartTreeReadOptions& _read_options,
+              const std::set<std::string>& _disabled_branches = {}, const std::set<std::string>& _enabled_branches ={})
+        : SmartTree(_name, _directory, true, _disabled_branches, _enabled_branches)
+    {
+        read_options = std::make_shared<SmartTreeReadOptions>(_read_options);
+    }
+
+    SmartTree(const std::string& _name, TDirectory* _directory, const SmartTreeWriteProfile& _write_profile,
+              const std::set<std::string>& _disabled_branches = {}, const std::set<std::string>& _enabled_branches ={})
+        : SmartTree(_name, _directory, false, _disabled_branches, _enabled_branches)
+    {
+        write_profile = std::make_shared<SmartTreeWriteProfile>(_write_profile);
+        if(directory) {
+            tree->SetMaxVirtualSize(write_profile->max_virtual_size);
+            tree->SetAutoFlush(write_profile->auto_flush);
+        }
+    }
+
     SmartTree(const SmartTree& other) = delete;
     SmartTree(const SmartTree&& other)
         : name(other.name), directory(other.directory), tree(other.tree),
-          disabled_branches(other.disabled_branches), enabled_branches(other.enabled_branches), entries(other.entries) {}
+          disabled_branches(other.disabled_branches), enabled_branches(other.enabled_branches),
+          derived_branches(other.derived_branches), derived_tree(other.derived_tree),
+          n_derived_trees(other.n_derived_trees), read_options(other.read_options), write_profile(other.write_profile),
+          read_profiler(other.read_profiler), entries(other.entries) {}
 
     virtual ~SmartTree()
     {
-        if(directory) directory->Delete(name.c_str());
-        else delete tree;
+        FinalizeRead();
+        if(directory) {
+            for(size_t n = 0; n <= n_derived_trees; ++n)
+                directory->Delete(DerivedTreeName(name, n).c_str());
+            directory->Delete(name.c_str());
+        } else
+            delete tree;
+    }
+
+    /// Read the list of branch names, one per line. Empty lines and text after '#' are ignored.
+    static std::set<std::string> LoadBranchList(const std::string& file_name)
+    {
+        std::ifstream f(file_name);
+        if(f.fail())
+            throw std::runtime_error("SmartTree: unable to open the branch list '" + file_name + "'.");
+        std::set<std::string> branches;
+        std::string line;
+        while(std::getline(f, line)) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream ss(line);
+            std::string branch_name;
+            if(ss >> branch_name)
+                branches.insert(branch_name);
+        }
+        return branches;
+    }
+
+    static void WriteBranchList(const std::string& file_name, const std::set<std::string>& branches,
+                                const std::string& comment = "")
+    {
+        std::ofstream f(file_name);
+        if(f.fail())
+            throw std::runtime_error("SmartTree: unable to create the branch list '" + file_name + "'.");
+        if(!comment.empty())
+            f << "# " << comment << "\n";
+        for(const auto& branch_name : branches)
+            f << branch_name << "\n";
+    }
+
+    static std::string DerivedTreeName(const std::string& tree_name, size_t index)
+    {
+        return tree_name + "_derived" + std::to_string(index);
     }
 
     Int_t Fill()
@@ -229,8 +624,10 @@ public:
         Int_t n_bytes = tree->Fill();
         if(n_bytes < 0)
             throw std::runtime_error("SmartTree: a write error occured during Fill.");
-        for(auto& entry : entries)
-            entry.second->clear();
+        if(write_profile && !baskets_optimized && tree->GetAutoFlush() > 0
+                && tree->GetEntries() >= tree->GetAutoFlush())
+            OptimizeBaskets();
+        ClearEntries();
         return n_bytes;
     }
 
@@ -241,7 +638,7 @@ public:
     Int_t GetEntry(Long64_t entry)
     {
         std::lock_guard<Mutex> lock(mutex);
-        const Int_t result = tree->GetEntry(entry);
+        const Int_t result = read_profiler ? read_profiler->ReadEntry(entry) : tree->GetEntry(entry);
         if(result <= 0) {
             std::ostringstream ss;
             ss << "SmartTree: ";
@@ -266,11 +663,78 @@ public:
         tree->SetAutoFlush(autof);
     }
 
+    /// Set up TTreeCache to prefetch exactly the active branches, without going through the learning phase.
+    void ConfigureReadCache(const SmartTreeReadOptions& options)
+    {
+        std::lock_guard<Mutex> lock(mutex);
+        if(!readMode)
+            throw std::runtime_error("SmartTree: read cache can be configured only in the read mode.");
+        if(!options.use_cache) {
+            tree->SetCacheSize(0);
+            return;
+        }
+        if(options.parallel_unzip)
+            tree->SetParallelUnzip(true);
+        const Long64_t cache_size = options.cache_size > 0 ? options.cache_size : EstimateCacheSize(options);
+        if(tree->SetCacheSize(cache_size) < 0)
+            throw std::runtime_error("SmartTree: unable to set the read cache size.");
+        for(TBranch* branch : GetStoredActiveBranches())
+            tree->AddBranchToCache(branch, true);
+        tree->StopCacheLearningPhase();
+    }
+
+    /// Compressed size of one cluster of the active branches scaled by the number of clusters to keep in the cache.
+    Long64_t EstimateCacheSize(const SmartTreeReadOptions& options)
+    {
+        std::lock_guard<Mutex> lock(mutex);
+        const Long64_t n_entries = GetEntries();
+        if(n_entries <= 0) return options.min_cache_size;
+        Long64_t active_zip_bytes = 0;
+        for(TBranch* branch : GetStoredActiveBranches())
+            active_zip_bytes += branch->GetZipBytes("*");
+        const auto clusters = GetClusterRanges(0, n_entries);
+        const double bytes_per_entry = double(active_zip_bytes) / n_entries;
+        const double entries_per_cluster = double(n_entries) / std::max<size_t>(clusters.size(), 1);
+        const auto cache_size = static_cast<Long64_t>(bytes_per_entry * entries_per_cluster
+                                                      * options.n_clusters_in_cache);
+        return std::min(std::max(cache_size, options.min_cache_size), options.max_cache_size);
+    }
+
+    /// Start collecting the per-branch read costs of the active branches.
+    void EnableReadProfiling()
+    {
+        std::lock_guard<Mutex> lock(mutex);
+        if(!readMode)
+            throw std::runtime_error("SmartTree: read profiling is available only in the read mode.");
+        read_profiler = std::make_shared<SmartTreeReadProfiler>(*tree, active_branches);
+    }
+
+    std::shared_ptr<const SmartTreeReadProfiler> GetReadProfiler() const { return read_profiler; }
+
+    /// Branches accessed by the user code. The base implementation does not track the access.
+    virtual std::set<std::string> GetAccessedBranches() const { return {}; }
+    /// True if all accesses to the data went through the tracked accessors.
+    virtual bool IsAccessTrackingComplete() const { return false; }
+
+    void PrintReadProfileReport(std::ostream& s) const
+    {
+        if(!read_profiler)
+            throw std::runtime_error("SmartTree: read profiling is not enabled.");
+        read_profiler->PrintReport(s, GetAccessedBranches());
+    }
+
     Int_t Write()
     {
         std::lock_guard<Mutex> lock(mutex);
         Int_t n_bytes = 0;
-        if(directory) {
+        if(directory && derived_tree) {
+            if(derived_tree->GetEntries() != GetEntries())
+                throw std::runtime_error("SmartTree: derived columns are not filled for all entries.");
+            derived_tree->FlushBaskets();
+            n_bytes = directory->WriteTObject(derived_tree, derived_tree->GetName(), "Overwrite");
+            if(!n_bytes)
+                throw std::runtime_error("SmartTree: the derived tree cannot be written.");
+        } else if(directory) {
             tree->FlushBaskets();
             n_bytes = directory->WriteTObject(tree, tree->GetName(), "Overwrite");
             if(!n_bytes)
@@ -279,9 +743,79 @@ public:
         return n_bytes;
     }
 
+    /// Fill the derived columns for the entry that was read last. Derived columns should be filled exactly once
+    /// for each entry, following the entry order.
+    Int_t FillDerived()
+    {
+        std::lock_guard<Mutex> lock(mutex);
+        if(!derived_tree)
+            throw std::runtime_error("SmartTree: there are no derived columns to fill.");
+        if(derived_tree->GetEntries() != GetReadEntry())
+            throw std::runtime_error("SmartTree: derived columns should be filled once per entry in the entry order.");
+        Int_t n_bytes = derived_tree->Fill();
+        if(n_bytes < 0)
+            throw std::runtime_error("SmartTree: a write error occured during FillDerived.");
+        for(const auto& branch_name : derived_branches)
+            entries.at(branch_name)->clear();
+        return n_bytes;
+    }
+
+    const std::set<std::string>& GetDerivedBranches() const { return derived_branches; }
+
     Mutex& GetMutex() { return mutex; }
+    const std::string& GetName() const { return name; }
+    TDirectory* GetDirectory() const { return directory; }
+    bool ReadMode() const { return readMode; }
+    const SmartTreeReadOptions* GetReadOptions() const { return read_options.get(); }
+    const std::set<std::string>& GetDisabledBranches() const { return disabled_branches; }
+    const std::set<std::string>& GetEnabledBranches() const { return enabled_branches; }
     const std::set<std::string>& GetActiveBranches() const { return active_branches; }
 
+    /// Boundaries [first, last) of the clusters that overlap with the entry range [first_entry, last_entry).
+    std::vector<std::pair<Long64_t, Long64_t>> GetClusterRanges(Long64_t first_entry, Long64_t last_entry)
+    {
+        std::lock_guard<Mutex> lock(mutex);
+        std::vector<std::pair<Long64_t, Long64_t>> clusters;
+        last_entry = std::min(last_entry, GetEntries());
+        auto cluster_iter = tree->GetClusterIterator(first_entry);
+        for(Long64_t start; (start = cluster_iter()) < last_entry;) {
+            const Long64_t end = std::min(cluster_iter.GetNextEntry(), last_entry);
+            clusters.emplace_back(std::max(start, first_entry), end);
+        }
+        return clusters;
+    }
+
+    SmartTreeBulkBlock CreateBulkBlock(const std::set<std::string>& branch_names) const
+    {
+        SmartTreeBulkBlock block;
+        for(const auto& branch_name : branch_names) {
+            auto iter = entries.find(branch_name);
+            if(iter == entries.end())
+                throw std::runtime_error("SmartTree: branch '" + branch_name + "' is not active.");
+            block.columns[branch_name] = iter->second->CreateBulkColumn();
+        }
+        return block;
+    }
+
+    /// Fill the columns of the block with up to n_entries starting from first_entry.
+    /// Returns the number of entries read, which is 0 once first_entry reaches the end of the tree.
+    /// Branches read entry by entry leave the tree-bound data at the last entry of the block.
+    Long64_t ReadBulk(Long64_t first_entry, Long64_t n_entries, SmartTreeBulkBlock& block)
+    {
+        std::lock_guard<Mutex> lock(mutex);
+        if(!readMode)
+            throw std::runtime_error("SmartTree: bulk read is available only in the read mode.");
+        block.first_entry = first_entry;
+        block.n_entries = std::max<Long64_t>(0, std::min(n_entries, GetEntries() - first_entry));
+        for(auto& column : block.columns) {
+            TBranch* branch = tree->GetBranch(column.first.c_str());
+            if(!branch)
+                throw std::runtime_error("SmartTree: branch '" + column.first + "' not found.");
+            column.second->Read(*branch, block.first_entry, block.n_entries);
+        }
+        return block.n_entries;
+    }
+
 protected:
     template<typename DataType>
     void AddBranch(const std::string& branch_name, DataType& value)
@@ -289,7 +823,16 @@ protected:
         std::lock_guard<Mutex> lock(mutex);
         if (!disabled_branches.count(branch_name) && (!enabled_branches.size() || enabled_branches.count(branch_name))){
             detail::BranchCreator<DataType> creator;
-            creator.Create(*tree, branch_name, value, readMode, entries);
+            if(readMode && read_options && read_options->derived_columns && !tree->GetBranch(branch_name.c_str())) {
+                creator.Create(GetDerivedTree(), branch_name, value, false, entries);
+                derived_branches.insert(branch_name);
+            } else if(!readMode && write_profile) {
+                const auto settings = write_profile->GetBranchSettings(branch_name);
+                creator.Create(*tree, branch_name, value, readMode, entries, settings.basket_size);
+                if(settings.compression_settings >= 0)
+                    tree->GetBranch(branch_name.c_str())->SetCompressionSettings(settings.compression_settings);
+            } else
+                creator.Create(*tree, branch_name, value, readMode, entries);
             active_branches.insert(branch_name);
         }
     }
@@ -299,12 +842,126 @@ protected:
         return entries.count(branch_name) != 0;
     }
 
+    virtual void ClearEntries()
+    {
+        for(auto& entry : entries)
+            entry.second->clear();
+    }
+
+    /// Write the read profile report and the access whitelist, if requested. It is called from the destructor
+    /// of the most derived tree class that tracks the access, so that GetAccessedBranches is still available.
+    void FinalizeRead()
+    {
+        if(read_finalized) return;
+        read_finalized = true;
+        try {
+            if(read_profiler)
+                WriteReadProfileReport();
+            if(readMode && read_options && read_options->track_access && !read_options->access_whitelist.empty()) {
+                if(!IsAccessTrackingComplete())
+                    throw std::runtime_error("the data was accessed without tracking, the access whitelist '"
+                                             + read_options->access_whitelist + "' is not written.");
+                WriteBranchList(read_options->access_whitelist, GetAccessedBranches(),
+                                "branches of '" + name + "' accessed by the user code");
+            }
+        } catch(std::exception& e) {
+            std::cerr << "WARNING: SmartTree '" << name << "': " << e.what() << std::endl;
+        }
+        read_profiler.reset();
+    }
+
+    void ApplyReadOptions()
+    {
+        if(readMode && read_options) {
+            ConfigureReadCache(*read_options);
+            if(read_options->profile_read)
+                EnableReadProfiling();
+        }
+    }
+
+private:
+    void WriteReadProfileReport() const
+    {
+        if(read_options && !read_options->profile_report.empty()) {
+            std::ofstream report(read_options->profile_report);
+            if(report.fail())
+                throw std::runtime_error("SmartTree: unable to create '" + read_options->profile_report + "'.");
+            PrintReadProfileReport(report);
+        } else {
+            PrintReadProfileReport(std::cout);
+        }
+    }
+
+    // Active branches that are stored in the tree itself. Derived branches and the names that don't match any branch
+    // of the tree (e.g. optional branches that are absent in the input file) are skipped.
+    std::vector<TBranch*> GetStoredActiveBranches() const
+    {
+        std::vector<TBranch*> branches;
+        for(const auto& branch_name : active_branches) {
+            if(derived_branches.count(branch_name)) continue;
+            if(TBranch* branch = tree->GetBranch(branch_name.c_str()))
+                branches.push_back(branch);
+        }
+        return branches;
+    }
+
+    // Derived trees written by the previous jobs are attached as friends, so their branches are read
+    // together with the main tree. Misaligned trees are skipped, but they keep their indices, so the new derived
+    // tree always gets the first free index and never overwrites an existing one.
+    void AttachDerivedTrees()
+    {
+        for(n_derived_trees = 0; ; ++n_derived_trees) {
+            const std::string derived_name = DerivedTreeName(name, n_derived_trees);
+            auto derived = dynamic_cast<TTree*>(directory->Get(derived_name.c_str()));
+            if(!derived) break;
+            if(derived->GetEntries() != tree->GetEntries()) {
+                std::cerr << "WARNING: derived tree '" << derived_name << "' is not aligned with the tree '" << name
+                          << "' and will be ignored." << std::endl;
+                continue;
+            }
+            tree->AddFriend(derived);
+        }
+    }
+
+    TTree& GetDerivedTree()
+    {
+        if(!derived_tree) {
+            const std::string derived_name = DerivedTreeName(name, n_derived_trees);
+            derived_tree = new TTree(derived_name.c_str(), derived_name.c_str());
+            derived_tree->SetDirectory(directory);
+        }
+        return *derived_tree;
+    }
+
+    // Called after the first cluster is flushed. At this point the auto flush is a number of entries, also for
+    // a negative auto_flush in the profile, and TTree::Fill has already called TTree::OptimizeBaskets with the size
+    // of the cluster as the memory limit. If requested by the profile, the basket memory is redistributed again
+    // within optimize_max_memory. In both cases the basket sizes explicitly set by the profile are restored.
+    void OptimizeBaskets()
+    {
+        if(write_profile->optimize_baskets)
+            tree->OptimizeBaskets(write_profile->optimize_max_memory, 1.1, "");
+        for(const auto& branch_name : active_branches) {
+            if(!write_profile->HasExplicitBasketSize(branch_name)) continue;
+            if(TBranch* branch = tree->GetBranch(branch_name.c_str()))
+                branch->SetBasketSize(write_profile->GetBranchSettings(branch_name).basket_size);
+        }
+        baskets_optimized = true;
+    }
+
 private:
     std::string name;
     TDirectory* directory;
     bool readMode;
     TTree* tree;
-    std::set<std::string> disabled_branches, enabled_branches, active_branches;
+    std::set<std::string> disabled_branches, enabled_branches, active_branches, derived_branches;
+    TTree* derived_tree{nullptr};
+    size_t n_derived_trees{0};
+    std::shared_ptr<const SmartTreeReadOptions> read_options;
+    std::shared_ptr<const SmartTreeWriteProfile> write_profile;
+    bool baskets_optimized{false};
+    std::shared_ptr<SmartTreeReadProfiler> read_profiler;
+    bool read_finalized{false};
     Mutex mutex;
 
 protected:
@@ -320,12 +977,12 @@ public:
         iterator(BaseSmartTree<Data>& _tree, Long64_t _pos) : tree(&_tree), data_read(false), pos(_pos) {}
 
         iterator& operator++() { data_read = false; ++pos; return *this; }
-        iterator operator++(int) const { return ++iterator(*this); }
+        iterator operator++(int) { iterator iter(*this); ++(*this); return iter; }
         iterator& operator--() { data_read = false; --pos; return *this; }
-        iterator operator--(int) const { return --iterator(*this); }
+        iterator operator--(int) { iterator iter(*this); --(*this); return iter; }
 
         const Data& operator*() { return GetData(); }
-        const Data* operator->() { return GetData(); }
+        const Data* operator->() { return &GetData(); }
 
         bool operator==(const iterator& other) const { return pos == other.pos && tree == other.tree; }
         bool operator!=(const iterator& other) const { return pos != other.pos || tree != other.tree; }
@@ -351,13 +1008,52 @@ public:
         Long64_t pos;
     };
 
+    /// Iterator that refers directly to the tree-bound data instead of copying it for each entry.
+    /// References obtained from it are valid until the tree is moved to another entry.
+    struct view_iterator {
+    public:
+        view_iterator(BaseSmartTree<Data>& _tree, Long64_t _pos) : tree(&_tree), pos(_pos) {}
+
+        view_iterator& operator++() { ++pos; return *this; }
+        view_iterator operator++(int) { view_iterator iter(*this); ++pos; return iter; }
+        view_iterator& operator--() { --pos; return *this; }
+        view_iterator operator--(int) { view_iterator iter(*this); --pos; return iter; }
+
+        const Data& operator*() const { return tree->GetEntryView(pos); }
+        const Data* operator->() const { return &tree->GetEntryView(pos); }
+        Data Take() const { return tree->TakeEntry(pos); }
+        Long64_t GetEntryIndex() const { return pos; }
+
+        bool operator==(const view_iterator& other) const { return pos == other.pos && tree == other.tree; }
+        bool operator!=(const view_iterator& other) const { return pos != other.pos || tree != other.tree; }
+
+    private:
+        BaseSmartTree<Data>* tree;
+        Long64_t pos;
+    };
+
+    struct view_range {
+    public:
+        view_range(BaseSmartTree<Data>& _tree, Long64_t _first, Long64_t _last) :
+            tree(&_tree), first(_first), last(_last) {}
+
+        view_iterator begin() const { return view_iterator(*tree, first); }
+        view_iterator end() const { return view_iterator(*tree, last); }
+
+    private:
+        BaseSmartTree<Data>* tree;
+        Long64_t first, last;
+    };
+
     using SmartTree::SmartTree;
     BaseSmartTree(const BaseSmartTree&& other)
         : SmartTree(other), _data(other._data) {}
 
-    Data& operator()() { return *_data; }
-    const Data& operator()() const { return *_data; }
-    const Data& data() const { return *_data; }
+    virtual ~BaseSmartTree() override { FinalizeRead(); }
+
+    Data& operator()() { MarkUntrackedAccess(); return *_data; }
+    const Data& operator()() const { MarkUntrackedAccess(); return *_data; }
+    const Data& data() const { MarkUntrackedAccess(); return *_data; }
 
     template<typename T>
     T& get(const std::string& branch_name)
@@ -368,6 +1064,10 @@ public:
         auto base_entry = dynamic_cast<detail::SmartTreePtrEntry<T>*>(iter->second.get());
         if(!base_entry)
             throw_invalid_type(branch_name);
+        if(track_access) {
+            std::lock_guard<std::mutex> lock(access_mutex);
+            accessed_branches.insert(branch_name);
+        }
         return *base_entry->value;
     }
 
@@ -380,13 +1080,96 @@ public:
         auto base_entry = dynamic_cast<const detail::SmartTreePtrEntry<T>*>(iter->second.get());
         if(!base_entry)
             throw_invalid_type(branch_name);
+        if(track_access) {
+            std::lock_guard<std::mutex> lock(access_mutex);
+            accessed_branches.insert(branch_name);
+        }
         return *base_entry->value;
     }
 
+    template<size_t index>
+    using BranchInfo = typename Data::template BranchInfo<index>;
+
+    static constexpr size_t BranchIndex(const char* branch_name)
+    {
+        return detail::BranchIndexFinder<Data>::Find(branch_name);
+    }
+
+    template<size_t index>
+    auto& get()
+    {
+        if(track_access)
+            accessed_table_entries[index].store(true, std::memory_order_relaxed);
+        return BranchInfo<index>::Get(*_data);
+    }
+
+    template<size_t index>
+    const auto& get() const
+    {
+        if(track_access)
+            accessed_table_entries[index].store(true, std::memory_order_relaxed);
+        return BranchInfo<index>::Get(static_cast<const Data&>(*_data));
+    }
+
+    /// Start recording which branches are accessed through get. Direct access to the data members
+    /// (e.g. via data() or the iterators) is not recorded, it only makes the tracking incomplete.
+    void EnableAccessTracking() { track_access = true; }
+    bool IsAccessTrackingEnabled() const { return track_access; }
+    virtual bool IsAccessTrackingComplete() const override { return track_access && !untracked_access; }
+
+    virtual std::set<std::string> GetAccessedBranches() const override
+    {
+        std::set<std::string> branches;
+        if(!track_access) return branches;
+        CollectAccessedBranches(branches, std::make_index_sequence<Data::BranchCount>());
+        std::lock_guard<std::mutex> lock(access_mutex);
+        for(const auto& branch_name : accessed_branches) {
+            if(HasBranch(branch_name))
+                branches.insert(branch_name);
+        }
+        return branches;
+    }
+
     iterator begin() { return iterator(*this, 0); }
     iterator end() { return iterator(*this, GetEntries()); }
 
+    view_range View() { return view_range(*this, 0, GetEntries()); }
+    view_range View(Long64_t first_entry, Long64_t last_entry)
+    {
+        return view_range(*this, first_entry, std::min(last_entry, GetEntries()));
+    }
+
+    /// Tree-bound data for the given entry. The entry is read only if the tree is not already positioned on it.
+    const Data& GetEntryView(Long64_t entry)
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        if(entry < 0 || entry >= GetEntries())
+            throw std::runtime_error("Tree entry index is out of range.");
+        if(data_moved_out || entry != GetReadEntry()) {
+            GetEntry(entry);
+            data_moved_out = false;
+        }
+        MarkUntrackedAccess();
+        return *_data;
+    }
+
+    /// Move the data of the given entry out of the tree-bound buffer.
+    /// The buffer is re-read on the next access to any entry.
+    Data TakeEntry(Long64_t entry)
+    {
+        std::lock_guard<Mutex> lock(GetMutex());
+        GetEntryView(entry);
+        data_moved_out = true;
+        return std::move(*_data);
+    }
+
 private:
+    void MarkUntrackedAccess() const
+    {
+        if(track_access)
+            untracked_access.store(true, std::memory_order_relaxed);
+    }
+
     void throw_branch_not_found(const std::string& branch_name) const
     {
         std::ostringstream ss;
@@ -401,8 +1184,66 @@ private:
         throw std::runtime_error(ss.str());
     }
 
+protected:
+    void InitializeBranchTable()
+    {
+        InitializeBranchTable(std::make_index_sequence<Data::BranchCount>());
+        if(ReadMode() && GetReadOptions() && GetReadOptions()->track_access)
+            EnableAccessTracking();
+    }
+
+    virtual void ClearEntries() override
+    {
+        if(n_table_entries != entries.size()) {
+            SmartTree::ClearEntries();
+            return;
+        }
+        ClearEntries(std::make_index_sequence<Data::BranchCount>());
+    }
+
+private:
+    template<size_t... index>
+    void InitializeBranchTable(std::index_sequence<index...>)
+    {
+        active_table_entries = { { HasBranch(BranchInfo<index>::Name())... } };
+        n_table_entries = static_cast<size_t>(std::count(active_table_entries.begin(), active_table_entries.end(),
+                                                         true));
+    }
+
+    template<size_t... index>
+    void CollectAccessedBranches(std::set<std::string>& branches, std::index_sequence<index...>) const
+    {
+        (void) std::initializer_list<int>{ (accessed_table_entries[index].load() && active_table_entries[index]
+                                            ? (branches.insert(BranchInfo<index>::Name()), 0) : 0)... };
+    }
+
+    template<size_t... index>
+    void ClearEntries(std::index_sequence<index...>)
+    {
+        (void) std::initializer_list<int>{ (ClearEntry<index>(), 0)... };
+    }
+
+    template<size_t index>
+    void ClearEntry()
+    {
+        if(active_table_entries[index]) {
+            auto& value = BranchInfo<index>::Get(*_data);
+            detail::BranchCleaner<std::remove_reference_t<decltype(value)>>::clear(value);
+        }
+    }
+
 protected:
     std::shared_ptr<Data> _data{new Data()};
+
+private:
+    bool data_moved_out{false};
+    std::array<bool, Data::BranchCount> active_table_entries{};
+    size_t n_table_entries{0};
+    bool track_access{false};
+    mutable std::array<std::atomic<bool>, Data::BranchCount> accessed_table_entries{};
+    mutable std::atomic<bool> untracked_access{false};
+    mutable std::mutex access_mutex;
+    mutable std::set<std::string> accessed_branches;
 };
 } // detail
 } // root_ext
@@ -0,0 +1,122 @@
+/*! Parallel processing of SmartTree entries split on the cluster boundaries.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <future>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <type_traits>
+
+#include <TROOT.h>
+
+#include "RootExt.h"
+#include "SmartTree.h"
+
+namespace root_ext {
+
+struct EntryRange {
+    Long64_t first{0}, last{std::numeric_limits<Long64_t>::max()};
+
+    EntryRange() {}
+    EntryRange(Long64_t _first, Long64_t _last) : first(_first), last(_last) {}
+};
+
+namespace detail {
+
+// Split clusters into n_parts contiguous groups with approximately the same number of entries.
+inline std::vector<EntryRange> SplitClusters(const std::vector<std::pair<Long64_t, Long64_t>>& clusters,
+                                             size_t n_parts)
+{
+    std::vector<EntryRange> parts;
+    if(clusters.empty()) return parts;
+    const Long64_t n_total = clusters.back().second - clusters.front().first;
+    const Long64_t n_per_part = std::max<Long64_t>(1, n_total / static_cast<Long64_t>(std::max<size_t>(n_parts, 1)));
+    for(const auto& cluster : clusters) {
+        if(parts.empty() || (parts.back().last - parts.back().first >= n_per_part && parts.size() < n_parts))
+            parts.emplace_back(cluster.first, cluster.second);
+        else
+            parts.back().last = cluster.second;
+    }
+    return parts;
+}
+
+inline std::string DirectoryPathInFile(const TDirectory& directory)
+{
+    const std::string path = directory.GetPath();
+    const size_t pos = path.find(":/");
+    return pos == std::string::npos ? "" : path.substr(pos + 2);
+}
+
+} // namespace detail
+
+/// Process entries of the tree in the given range using n_threads workers. Each worker opens its own copy
+/// of the input file and tree, so the data passed to the functor is private to the worker. Every worker starts
+/// from a value-initialized accumulator, which should be the identity of the merge; the per-worker accumulators are
+/// merged into init in the entry order at the end, so init is counted exactly once.
+/// Functor signature: void(const Data&, Accumulator&). Merge signature: void(Accumulator&, const Accumulator&).
+template<typename Tree, typename Accumulator, typename Function, typename MergeFunction>
+Accumulator ParallelForEach(Tree& tree, const EntryRange& range, size_t n_threads, Function functor,
+                            const Accumulator& init, MergeFunction merge)
+{
+    static_assert(std::is_default_constructible<Accumulator>::value,
+                  "ParallelForEach: the worker accumulators are value-initialized.");
+    if(!tree.ReadMode() || !tree.GetDirectory() || !tree.GetDirectory()->GetFile())
+        throw analysis::exception("ParallelForEach: tree '%1%' should be opened from a file in the read mode.")
+            % tree.GetName();
+
+    const auto clusters = tree.GetClusterRanges(range.first, range.last);
+    const auto parts = detail::SplitClusters(clusters, std::max<size_t>(n_threads, 1));
+    const std::string file_name = tree.GetDirectory()->GetFile()->GetName();
+    const std::string dir_name = detail::DirectoryPathInFile(*tree.GetDirectory());
+
+    // The workers use the read options of the source tree. Each worker writes its own profile report and access
+    // whitelist, with the part index appended to the file names.
+    const auto create_worker_tree = [&](TDirectory* worker_dir, size_t part_index) {
+        const SmartTreeReadOptions* read_options = tree.GetReadOptions();
+        if(!read_options)
+            return std::make_unique<Tree>(tree.GetName(), worker_dir, true, tree.GetDisabledBranches(),
+                                          tree.GetEnabledBranches());
+        SmartTreeReadOptions worker_options(*read_options);
+        const std::string suffix = "." + std::to_string(part_index);
+        if(!worker_options.profile_report.empty())
+            worker_options.profile_report += suffix;
+        if(!worker_options.access_whitelist.empty())
+            worker_options.access_whitelist += suffix;
+        return std::make_unique<Tree>(tree.GetName(), worker_dir, worker_options, tree.GetDisabledBranches(),
+                                      tree.GetEnabledBranches());
+    };
+
+    const auto process_part = [&](size_t part_index) {
+        const EntryRange& part = parts.at(part_index);
+        Accumulator accumulator{};
+        auto file = OpenRootFile(file_name);
+        auto worker_tree = create_worker_tree(GetDirectory(*file, dir_name, false), part_index);
+        for(Long64_t n = part.first; n < part.last; ++n) {
+            worker_tree->GetEntry(n);
+            functor(worker_tree->data(), accumulator);
+        }
+        return accumulator;
+    };
+
+    ROOT::EnableThreadSafety();
+    std::vector<std::future<Accumulator>> results;
+    for(size_t n = 0; n < parts.size(); ++n)
+        results.push_back(std::async(std::launch::async, process_part, n));
+
+    Accumulator total(init);
+    for(auto& result : results)
+        merge(total, result.get());
+    return total;
+}
+
+template<typename Tree, typename Function>
+void ParallelForEach(Tree& tree, const EntryRange& range, size_t n_threads, Function functor)
+{
+    struct NoAccumulator {};
+    const auto process = [&](const auto& data, NoAccumulator&) { functor(data); };
+    ParallelForEach(tree, range, n_threads, process, NoAccumulator(), [](NoAccumulator&, const NoAccumulator&) {});
+}
+
+} // namespace root_ext
@@ -0,0 +1,183 @@
+/*! Per-branch read-cost profiler for SmartTree.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include <TBasket.h>
+#include <TBranch.h>
+#include <TTree.h>
+#include <TTreePerfStats.h>
+
+namespace root_ext {
+
+struct BranchReadStats {
+    Long64_t n_reads{0}; ///< number of GetEntry calls
+    Long64_t n_baskets{0}; ///< number of baskets loaded from the file
+    Long64_t zip_bytes{0}; ///< compressed size of the loaded baskets
+    Long64_t unzip_bytes{0}; ///< uncompressed size of the loaded baskets
+    double read_time{0}; ///< total time spent in GetEntry, seconds
+    double unzip_time{0}; ///< time spent in GetEntry calls that loaded a new basket, seconds
+};
+
+/// Reads the active branches one by one and measures the I/O cost of each of them.
+/// Tree-level totals are collected by TTreePerfStats attached to the tree.
+class SmartTreeReadProfiler {
+public:
+    using StatsMap = std::map<std::string, BranchReadStats>;
+    using clock = std::chrono::steady_clock;
+
+    SmartTreeReadProfiler(TTree& _tree, const std::set<std::string>& branch_names) :
+        tree(&_tree), perf_stats(std::make_shared<TTreePerfStats>("SmartTreeReadProfiler", tree))
+    {
+        for(const auto& branch_name : branch_names) {
+            TBranch* branch = tree->GetBranch(branch_name.c_str());
+            if(!branch) continue;
+            ProfiledBranch profiled;
+            profiled.name = branch_name;
+            profiled.branch = branch;
+            CollectSubBranches(*branch, profiled.sub_branches);
+            profiled.last_baskets.resize(profiled.sub_branches.size(), -1);
+            branches.push_back(profiled);
+        }
+    }
+
+    SmartTreeReadProfiler(const SmartTreeReadProfiler&) = delete;
+    SmartTreeReadProfiler& operator=(const SmartTreeReadProfiler&) = delete;
+
+    ~SmartTreeReadProfiler()
+    {
+        if(tree->GetPerfStats() == perf_stats.get())
+            tree->SetPerfStats(nullptr);
+    }
+
+    /// Same return convention as TTree::GetEntry.
+    Int_t ReadEntry(Long64_t entry)
+    {
+        if(tree->LoadTree(entry) < 0) return 0;
+        Int_t total_bytes = 0;
+        for(auto& profiled : branches) {
+            const auto start = clock::now();
+            const Int_t n_bytes = profiled.branch->GetEntry(entry);
+            const double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+            if(n_bytes < 0) return n_bytes;
+            total_bytes += n_bytes;
+
+            BranchReadStats& branch_stats = stats[profiled.name];
+            ++branch_stats.n_reads;
+            branch_stats.read_time += elapsed;
+            bool new_basket = false;
+            for(size_t n = 0; n < profiled.sub_branches.size(); ++n) {
+                TBranch* sub_branch = profiled.sub_branches.at(n);
+                const Int_t basket_id = sub_branch->GetReadBasket();
+                if(basket_id == profiled.last_baskets.at(n)) continue;
+                profiled.last_baskets.at(n) = basket_id;
+                new_basket = true;
+                ++branch_stats.n_baskets;
+                if(basket_id < sub_branch->GetWriteBasket())
+                    branch_stats.zip_bytes += sub_branch->GetBasketBytes()[basket_id];
+                if(TBasket* basket = sub_branch->GetBasket(basket_id))
+                    branch_stats.unzip_bytes += basket->GetObjlen();
+            }
+            if(new_basket)
+                branch_stats.unzip_time += elapsed;
+        }
+        return total_bytes;
+    }
+
+    const StatsMap& GetStats() const { return stats; }
+    const TTreePerfStats& GetPerfStats() const { return *perf_stats; }
+
+    /// Minimal set of branches to enable: the accessed branches that are available in the tree.
+    std::set<std::string> SuggestEnabledBranches(const std::set<std::string>& accessed_branches) const
+    {
+        std::set<std::string> suggested;
+        for(const auto& profiled : branches) {
+            if(accessed_branches.count(profiled.name))
+                suggested.insert(profiled.name);
+        }
+        return suggested;
+    }
+
+    /// Print the per-branch costs ordered by the compressed bytes read. If the set of branches accessed by
+    /// the user code is provided, the branches that were read but never accessed are marked and
+    /// the suggested enabled_branches list is printed.
+    void PrintReport(std::ostream& s, const std::set<std::string>& accessed_branches = {}) const
+    {
+        std::vector<std::pair<std::string, const BranchReadStats*>> ordered;
+        Long64_t total_zip_bytes = 0;
+        for(const auto& entry : stats) {
+            ordered.emplace_back(entry.first, &entry.second);
+            total_zip_bytes += entry.second.zip_bytes;
+        }
+        std::sort(ordered.begin(), ordered.end(), [](const auto& a, const auto& b) {
+            if(a.second->zip_bytes != b.second->zip_bytes) return a.second->zip_bytes > b.second->zip_bytes;
+            return a.first < b.first;
+        });
+
+        const bool has_access_info = !accessed_branches.empty();
+        s << "SmartTree read profile for '" << tree->GetName() << "'\n" << std::left
+          << std::setw(30) << "Name" << std::setw(14) << "Zip bytes" << std::setw(10) << "% Total"
+          << std::setw(14) << "Unzip bytes" << std::setw(10) << "Baskets" << std::setw(12) << "Unzip s"
+          << std::setw(12) << "Read s" << (has_access_info ? "Accessed" : "") << "\n";
+        Long64_t unused_zip_bytes = 0;
+        for(const auto& entry : ordered) {
+            const BranchReadStats& branch_stats = *entry.second;
+            const bool accessed = accessed_branches.count(entry.first);
+            if(has_access_info && !accessed)
+                unused_zip_bytes += branch_stats.zip_bytes;
+            s << std::fixed << std::setprecision(2)
+              << std::setw(30) << entry.first << std::setw(14) << branch_stats.zip_bytes
+              << std::setw(10) << (total_zip_bytes ? 100. * branch_stats.zip_bytes / total_zip_bytes : 0.)
+              << std::setw(14) << branch_stats.unzip_bytes << std::setw(10) << branch_stats.n_baskets
+              << std::setprecision(4) << std::setw(12) << branch_stats.unzip_time
+              << std::setw(12) << branch_stats.read_time << (has_access_info ? (accessed ? "yes" : "no") : "")
+              << "\n";
+        }
+        s << "Total: zip_bytes = " << total_zip_bytes << ", bytes_read = " << perf_stats->GetBytesRead()
+          << ", read_calls = " << perf_stats->GetReadCalls() << ", unzip_time = " << perf_stats->GetUnzipTime()
+          << " s.\n";
+
+        if(has_access_info) {
+            s << "Bytes read for branches that were never accessed: " << unused_zip_bytes << " ("
+              << std::setprecision(2) << (total_zip_bytes ? 100. * unused_zip_bytes / total_zip_bytes : 0.)
+              << "%).\nSuggested enabled_branches:";
+            for(const auto& branch_name : SuggestEnabledBranches(accessed_branches))
+                s << " " << branch_name;
+            s << "\n";
+        }
+        s << std::flush;
+    }
+
+private:
+    struct ProfiledBranch {
+        std::string name;
+        TBranch* branch;
+        std::vector<TBranch*> sub_branches;
+        std::vector<Int_t> last_baskets;
+    };
+
+    static void CollectSubBranches(TBranch& branch, std::vector<TBranch*>& sub_branches)
+    {
+        sub_branches.push_back(&branch);
+        auto list = branch.GetListOfBranches();
+        for(auto sub_branch : *list)
+            CollectSubBranches(*dynamic_cast<TBranch*>(sub_branch), sub_branches);
+    }
+
+private:
+    TTree* tree;
+    std::shared_ptr<TTreePerfStats> perf_stats;
+    std::vector<ProfiledBranch> branches;
+    StatsMap stats;
+};
+
+} // namespace root_ext
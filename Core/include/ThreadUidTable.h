@@ -0,0 +1,52 @@
+/*! Thread-local tables keyed by the unique ids of objects.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+
+namespace root_ext {
+namespace detail {
+
+// Unique ids of the existing objects that own items in the thread-local tables. An id is never reused after it is
+// released.
+size_t AcquireUid();
+void ReleaseUid(size_t uid);
+bool IsUidInUse(size_t uid);
+
+// Thread-local table keyed by the uid of an object. The items of the destroyed objects can't be removed by
+// the thread that destroys them, so they are dropped when the table has doubled in size since the last cleanup.
+template<typename Value>
+class ThreadUidTable {
+public:
+    Value* Find(size_t uid)
+    {
+        auto iter = table.find(uid);
+        return iter != table.end() ? &iter->second : nullptr;
+    }
+
+    Value& operator[](size_t uid)
+    {
+        if(Value* value = Find(uid))
+            return *value;
+        if(table.size() >= cleanup_size) {
+            for(auto item = table.begin(); item != table.end();)
+                item = IsUidInUse(item->first) ? std::next(item) : table.erase(item);
+            cleanup_size = std::max(MinCleanupSize, 2 * table.size());
+        }
+        return table[uid];
+    }
+
+private:
+    static constexpr size_t MinCleanupSize = 16;
+    std::unordered_map<size_t, Value> table;
+    size_t cleanup_size{MinCleanupSize};
+};
+
+template<typename Value>
+constexpr size_t ThreadUidTable<Value>::MinCleanupSize;
+
+} // namespace detail
+} // namespace root_ext
@@ -0,0 +1,230 @@
+/*! Chunked column storage for the unbinned values that can be filled from several threads without locks.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "exception.h"
+#include "ThreadUidTable.h"
+
+namespace root_ext {
+namespace detail {
+
+class ValueColumnsBase {
+public:
+    // Total size of the blocks kept in memory by all columns. When it is exceeded, the full blocks of the thread
+    // that allocates a new block are moved to a temporary file.
+    static void SetMemoryLimit(size_t bytes) { MemoryLimit() = bytes; }
+    static size_t GetMemoryLimit() { return MemoryLimit(); }
+    static size_t GetMemoryUsage() { return MemoryUsage(); }
+
+protected:
+    static std::atomic<size_t>& MemoryLimit()
+    {
+        static std::atomic<size_t> limit(size_t(1) << 30);
+        return limit;
+    }
+
+    static std::atomic<size_t>& MemoryUsage()
+    {
+        static std::atomic<size_t> usage(0);
+        return usage;
+    }
+};
+
+// N columns of values of type T. Each thread appends to its own lane of blocks, so Append takes no locks.
+// A block stores capacity values of each column one after another. The first block of a lane is small and
+// the following blocks grow geometrically up to MaxBlockSize, so a lane with a few values takes little memory.
+// The content should be read only when no other thread is appending.
+template<typename T, size_t N>
+class ValueColumns : public ValueColumnsBase {
+public:
+    static constexpr size_t MinBlockSize = 256;
+    static constexpr size_t MaxBlockSize = 64 * 1024;
+    using Values = std::array<T, N>;
+    using ColumnPointers = std::array<const T*, N>;
+
+    ValueColumns() : uid(AcquireUid()) {}
+    ValueColumns(const ValueColumns& other) : ValueColumns() { AppendAll(other); }
+    ValueColumns& operator=(const ValueColumns&) = delete;
+    ~ValueColumns()
+    {
+        Clear();
+        ReleaseUid(uid);
+    }
+
+    void Append(const Values& values)
+    {
+        Lane& lane = GetLane();
+        if(lane.blocks.empty() || lane.last_size == lane.blocks.back().capacity)
+            AddBlock(lane);
+        Block& block = lane.blocks.back();
+        for(size_t n = 0; n < N; ++n)
+            block.data[n * block.capacity + lane.last_size] = values[n];
+        ++lane.last_size;
+    }
+
+    void AppendAll(const ValueColumns& other)
+    {
+        other.ForEachBlock([&](const ColumnPointers& columns, size_t n_values) {
+            Values values;
+            for(size_t k = 0; k < n_values; ++k) {
+                for(size_t n = 0; n < N; ++n)
+                    values[n] = columns[n][k];
+                Append(values);
+            }
+        });
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t total = 0;
+        for(const auto& lane : lanes)
+            total += lane->size();
+        return total;
+    }
+
+    // Call functor(columns, n_values) for every block in the order of the lanes creation, where columns[n] points
+    // to n_values values of the column n. The spilled blocks of a lane are read back from the temporary file
+    // one by one.
+    template<typename Function>
+    void ForEachBlock(Function functor) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unique_ptr<T[]> buffer;
+        ColumnPointers columns;
+        for(const auto& lane : lanes) {
+            if(lane->n_spilled) {
+                if(!buffer)
+                    buffer.reset(new T[N * MaxBlockSize]);
+                std::rewind(lane->spill_file.get());
+                for(size_t n_read = 0; n_read < lane->n_spilled;) {
+                    uint64_t n_values;
+                    if(std::fread(&n_values, sizeof(n_values), 1, lane->spill_file.get()) != 1
+                            || n_values > MaxBlockSize
+                            || std::fread(buffer.get(), sizeof(T) * N * n_values, 1, lane->spill_file.get()) != 1)
+                        throw analysis::exception("Unable to read the values back from the temporary file.");
+                    for(size_t n = 0; n < N; ++n)
+                        columns[n] = buffer.get() + n * n_values;
+                    functor(columns, static_cast<size_t>(n_values));
+                    n_read += n_values;
+                }
+                std::fseek(lane->spill_file.get(), 0, SEEK_END);
+            }
+            for(size_t k = 0; k < lane->blocks.size(); ++k) {
+                const Block& block = lane->blocks.at(k);
+                for(size_t n = 0; n < N; ++n)
+                    columns[n] = block.data.get() + n * block.capacity;
+                functor(columns, k + 1 == lane->blocks.size() ? lane->last_size : block.capacity);
+            }
+        }
+    }
+
+    // The lanes are only emptied, because they are referenced from the thread-local tables.
+    void Clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto& lane : lanes) {
+            for(const auto& block : lane->blocks)
+                MemoryUsage() -= BlockBytes(block.capacity);
+            lane->blocks.clear();
+            lane->last_size = 0;
+            lane->last_capacity = 0;
+            lane->n_spilled = 0;
+            lane->spill_file.reset();
+        }
+    }
+
+private:
+    struct FileCloser {
+        void operator()(std::FILE* file) const { std::fclose(file); }
+    };
+
+    struct Block {
+        std::unique_ptr<T[]> data;
+        size_t capacity;
+    };
+
+    struct Lane {
+        std::vector<Block> blocks; // all blocks except the last one are full
+        size_t last_size{0}, last_capacity{0};
+        size_t n_spilled{0};
+        std::unique_ptr<std::FILE, FileCloser> spill_file;
+
+        size_t size() const
+        {
+            size_t total = n_spilled;
+            for(size_t k = 0; k < blocks.size(); ++k)
+                total += k + 1 == blocks.size() ? last_size : blocks.at(k).capacity;
+            return total;
+        }
+    };
+
+    static size_t BlockBytes(size_t capacity) { return N * capacity * sizeof(T); }
+
+    Lane& GetLane()
+    {
+        static thread_local ThreadUidTable<Lane*> thread_lanes;
+        Lane*& lane = thread_lanes[uid];
+        if(!lane) {
+            std::lock_guard<std::mutex> lock(mutex);
+            lanes.push_back(std::make_unique<Lane>());
+            lane = lanes.back().get();
+        }
+        return *lane;
+    }
+
+    // The memory usage includes the whole capacity of the partially filled blocks. When the limit would be
+    // exceeded, the blocks of the lane are moved to the temporary file and the lane restarts from a small block.
+    void AddBlock(Lane& lane)
+    {
+        size_t capacity = std::min(std::max(2 * lane.last_capacity, size_t(MinBlockSize)), size_t(MaxBlockSize));
+        if(MemoryUsage() + BlockBytes(capacity) > MemoryLimit()) {
+            Spill(lane);
+            capacity = MinBlockSize;
+        }
+        lane.blocks.push_back(Block{ std::unique_ptr<T[]>(new T[N * capacity]), capacity });
+        lane.last_size = 0;
+        lane.last_capacity = capacity;
+        MemoryUsage() += BlockBytes(capacity);
+    }
+
+    // Called only when all blocks of the lane are full. Each block is stored as the number of values followed by
+    // the values of each column.
+    void Spill(Lane& lane)
+    {
+        if(lane.blocks.empty()) return;
+        if(!lane.spill_file) {
+            lane.spill_file.reset(std::tmpfile());
+            if(!lane.spill_file)
+                throw analysis::exception("Unable to create a temporary file to store the values.");
+        }
+        for(const auto& block : lane.blocks) {
+            const uint64_t n_values = block.capacity;
+            if(std::fwrite(&n_values, sizeof(n_values), 1, lane.spill_file.get()) != 1
+                    || std::fwrite(block.data.get(), BlockBytes(block.capacity), 1, lane.spill_file.get()) != 1)
+                throw analysis::exception("Unable to write the values into the temporary file.");
+            lane.n_spilled += block.capacity;
+            MemoryUsage() -= BlockBytes(block.capacity);
+        }
+        lane.blocks.clear();
+    }
+
+private:
+    const size_t uid; // unique for the lifetime of the process, used as a key for the thread-local lookups
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<Lane>> lanes;
+};
+
+} // namespace detail
+} // namespace root_ext
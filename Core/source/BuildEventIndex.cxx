@@ -0,0 +1,55 @@
+/*! Build an index that maps event identifiers to tree entries.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include <iostream>
+
+#include <TTree.h>
+#include "RootExt.h"
+#include "AnalysisTools/Run/include/program_main.h"
+#include "AnalysisTools/Core/include/EventIndex.h"
+
+struct Arguments {
+    REQ_ARG(std::string, fileName);
+    REQ_ARG(std::string, treeName);
+    OPT_ARG(std::string, eventIdBranches, "run:lumi:evt");
+    OPT_ARG(bool, sidecar, true);
+};
+
+class BuildEventIndex {
+public:
+    using EventIndex = analysis::EventIndex;
+    using EventIdentifier = analysis::EventIdentifier;
+
+    BuildEventIndex(const Arguments& _args) : args(_args) {}
+
+    void Run()
+    {
+        const auto id_branches = EventIdentifier::Split(args.eventIdBranches());
+        const std::string index_path = EventIndex::IndexName(args.treeName());
+        const size_t dir_name_end = index_path.find_last_of('/');
+        const std::string dir_name = dir_name_end == std::string::npos ? "" : index_path.substr(0, dir_name_end);
+        const std::string index_name = index_path.substr(dir_name_end == std::string::npos ? 0 : dir_name_end + 1);
+
+        std::shared_ptr<TFile> input_file, output_file;
+        if(args.sidecar()) {
+            input_file = root_ext::OpenRootFile(args.fileName());
+            output_file = root_ext::CreateRootFile(EventIndex::SidecarFileName(args.fileName()));
+        } else {
+            input_file = std::shared_ptr<TFile>(TFile::Open(args.fileName().c_str(), "UPDATE"));
+            if(!input_file || input_file->IsZombie())
+                throw analysis::exception("File '%1%' not opened for update.") % args.fileName();
+            output_file = input_file;
+        }
+
+        auto tree = root_ext::ReadObject<TTree>(*input_file, args.treeName());
+        auto output_dir = root_ext::GetDirectory(*output_file, dir_name);
+        EventIndex::Build(*tree, id_branches, *output_dir, index_name);
+        std::cout << "Event index for " << tree->GetEntries() << " entries of '" << args.treeName()
+                  << "' has been written into '" << output_file->GetName() << "'." << std::endl;
+    }
+
+private:
+    Arguments args;
+};
+
+PROGRAM_MAIN(BuildEventIndex, Arguments)
@@ -1,77 +1,308 @@
 /*! Dump branch statistics.
 This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 
+#include <atomic>
+#include <future>
 #include <iostream>
+#include <mutex>
 
+#include <boost/filesystem.hpp>
+#include <TROOT.h>
 #include <TTree.h>
 #include "RootExt.h"
 #include "AnalysisTools/Run/include/program_main.h"
+#include "AnalysisTools/Core/include/CompressionBenchmark.h"
 #include "AnalysisTools/Core/include/SmartBranch.h"
 #include "AnalysisTools/Core/include/EnumNameMap.h"
+#include "AnalysisTools/Core/include/RootFilesMerger.h"
+#include "AnalysisTools/Core/include/TextIO.h"
 
 struct Arguments {
     REQ_ARG(std::string, fileName);
     REQ_ARG(std::string, treeName);
     OPT_ARG(std::string, ordering, "zipsize");
+    OPT_ARG(unsigned, nThreads, 1);
+    OPT_ARG(std::string, fileNamePattern, "^.*\\.root$");
+    OPT_ARG(bool, benchmarkCompression, false);
+    OPT_ARG(size_t, benchmarkBaskets, 10);
+    OPT_ARG(double, ioBandwidth, 100);
 };
 
-enum class BranchOrdering { Name, Size, ZipSize, CompressionFactor };
+enum class BranchOrdering { Name, Size, ZipSize, CompressionFactor, Baskets };
 
 ENUM_NAMES(BranchOrdering) = {
     { BranchOrdering::Name, "name" },
     { BranchOrdering::Size, "size" },
     { BranchOrdering::ZipSize, "zipsize" },
     { BranchOrdering::CompressionFactor, "compression" },
+    { BranchOrdering::Baskets, "baskets" },
+};
+
+struct BranchStats {
+    std::string name, class_name;
+    Long64_t n_entries{0}, raw_size{0}, zip_size{0}, n_baskets{0};
+    Int_t basket_buffer_size{0};
+
+    BranchStats() {}
+    explicit BranchStats(TBranch& branch) :
+        name(branch.GetName()), class_name(branch.GetClassName()), n_entries(branch.GetEntries()),
+        raw_size(std::max(branch.GetTotalSize(), branch.GetTotBytes("*"))), zip_size(branch.GetZipBytes("*"))
+    {
+        CollectBaskets(branch);
+    }
+
+    double CompressionFactor() const { return zip_size ? double(raw_size) / zip_size : 0; }
+    double AverageBasketSize() const { return n_baskets ? double(zip_size) / n_baskets : 0; }
+    double EntriesPerBasket() const { return n_baskets ? double(n_entries) / n_baskets : 0; }
+
+    BranchStats& operator+=(const BranchStats& other)
+    {
+        if(name.empty()) {
+            name = other.name;
+            class_name = other.class_name;
+        }
+        n_entries += other.n_entries;
+        raw_size += other.raw_size;
+        zip_size += other.zip_size;
+        n_baskets += other.n_baskets;
+        basket_buffer_size = std::max(basket_buffer_size, other.basket_buffer_size);
+        return *this;
+    }
+
+private:
+    void CollectBaskets(TBranch& branch)
+    {
+        n_baskets += branch.GetWriteBasket();
+        basket_buffer_size = std::max(basket_buffer_size, branch.GetBasketSize());
+        auto sub_branches = branch.GetListOfBranches();
+        for(auto sub_branch : *sub_branches)
+            CollectBaskets(*dynamic_cast<TBranch*>(sub_branch));
+    }
+};
+
+struct TreeStats {
+    size_t n_files{0};
+    Long64_t n_entries{0}, zip_size{0}, n_clusters{0};
+    std::map<std::string, BranchStats> branches;
+
+    TreeStats() {}
+    explicit TreeStats(TTree& tree) :
+        n_files(1), n_entries(tree.GetEntries()), zip_size(tree.GetZipBytes())
+    {
+        auto cluster_iter = tree.GetClusterIterator(0);
+        for(Long64_t start = cluster_iter(); start < n_entries; start = cluster_iter())
+            ++n_clusters;
+
+        for(const std::string& name : root_ext::SmartBranch::CollectBranchNames(tree))
+            branches[name] = BranchStats(*tree.GetBranch(name.c_str()));
+    }
+
+    TreeStats& operator+=(const TreeStats& other)
+    {
+        n_files += other.n_files;
+        n_entries += other.n_entries;
+        zip_size += other.zip_size;
+        n_clusters += other.n_clusters;
+        for(const auto& branch : other.branches)
+            branches[branch.first] += branch.second;
+        return *this;
+    }
 };
 
 class DumpBranchStats {
 public:
     using exception = analysis::exception;
-    using SmartBranch = root_ext::SmartBranch;
 
-    DumpBranchStats(const Arguments& args) :
-        file(root_ext::OpenRootFile(args.fileName())),
-        tree(root_ext::ReadObject<TTree>(*file, args.treeName())),
-        ordering(analysis::EnumNameMap<BranchOrdering>::GetDefault().Parse(args.ordering()))
+    DumpBranchStats(const Arguments& _args) :
+        args(_args), ordering(analysis::EnumNameMap<BranchOrdering>::GetDefault().Parse(args.ordering()))
     {
+        for(const auto& path : analysis::SplitValueList(args.fileName(), false, ",")) {
+            if(boost::filesystem::is_directory(path)) {
+                const auto dir_files = analysis::RootFilesMerger::FindInputFiles({ path }, args.fileNamePattern(),
+                                                                                 "", "");
+                file_names.insert(file_names.end(), dir_files.begin(), dir_files.end());
+            } else {
+                file_names.push_back(path);
+            }
+        }
+        if(file_names.empty())
+            throw exception("No input files found.");
     }
 
     void Run()
     {
-        std::vector<SmartBranch> branches;
-        const auto branch_names = SmartBranch::CollectBranchNames(*tree);
-        for(const std::string& name : branch_names) {
-            try {
-                SmartBranch branch(*tree, name);
-                branches.push_back(branch);
-            } catch(exception& e) {
-                std::cerr << e.what() << std::endl;
-            }
-        }
+        const TreeStats stats = CollectStats();
+        if(!stats.n_files)
+            throw exception("Tree '%1%' is not found in any of the input files.") % args.treeName();
+
+        std::vector<const BranchStats*> branches;
+        for(const auto& branch : stats.branches)
+            branches.push_back(&branch.second);
 
-        const auto comparitor = [&](const SmartBranch& b1, const SmartBranch& b2) -> bool {
-            if(ordering == BranchOrdering::Size && b1.RawSize() != b2.RawSize())
-                return b1.RawSize() > b2.RawSize();
-            if(ordering == BranchOrdering::ZipSize && b1.ZipSize() != b2.ZipSize())
-                return b1.ZipSize() > b2.ZipSize();
-            if(ordering == BranchOrdering::CompressionFactor && b1.CompressionFactor() != b2.CompressionFactor())
-                return b1.CompressionFactor() > b2.CompressionFactor();
-            return b1.Name() < b2.Name();
+        const auto comparitor = [&](const BranchStats* b1, const BranchStats* b2) -> bool {
+            if(ordering == BranchOrdering::Size && b1->raw_size != b2->raw_size)
+                return b1->raw_size > b2->raw_size;
+            if(ordering == BranchOrdering::ZipSize && b1->zip_size != b2->zip_size)
+                return b1->zip_size > b2->zip_size;
+            if(ordering == BranchOrdering::CompressionFactor && b1->CompressionFactor() != b2->CompressionFactor())
+                return b1->CompressionFactor() > b2->CompressionFactor();
+            if(ordering == BranchOrdering::Baskets && b1->n_baskets != b2->n_baskets)
+                return b1->n_baskets > b2->n_baskets;
+            return b1->name < b2->name;
         };
 
         std::sort(branches.begin(), branches.end(), comparitor);
-        SmartBranch::PrintStatsHeader(std::cout);
+        PrintStatsHeader(std::cout);
         for(const auto& branch : branches)
-            branch.PrintStats(std::cout);
-        const double bytes_per_entry = double(tree->GetZipBytes()) / tree->GetEntries();
-        std::cout << "\nTotal: n_entries = " << tree->GetEntries() << ", zip_size = " << tree->GetZipBytes()
-                  << ", bytes_per_entry = " << bytes_per_entry << "." << std::endl;
+            PrintStats(std::cout, *branch, stats.zip_size);
+
+        const double bytes_per_entry = stats.n_entries ? double(stats.zip_size) / stats.n_entries : 0;
+        const double entries_per_cluster = stats.n_clusters ? double(stats.n_entries) / stats.n_clusters : 0;
+        const double bytes_per_cluster = stats.n_clusters ? double(stats.zip_size) / stats.n_clusters : 0;
+        std::cout << "\nTotal: n_files = " << stats.n_files << ", n_entries = " << stats.n_entries
+                  << ", zip_size = " << stats.zip_size << ", bytes_per_entry = " << bytes_per_entry
+                  << ".\nClusters: n_clusters = " << stats.n_clusters << ", entries_per_cluster = "
+                  << entries_per_cluster << ", bytes_per_cluster = " << bytes_per_cluster << "." << std::endl;
+
+        if(args.benchmarkCompression())
+            RunCompressionBenchmark(branches);
+    }
+
+private:
+    // Files are distributed dynamically between the workers. The statistics are additive, so the result does not
+    // depend on the order in which the files are processed.
+    TreeStats CollectStats() const
+    {
+        const size_t n_workers = std::max<size_t>(1, std::min<size_t>(args.nThreads(), file_names.size()));
+        std::atomic<size_t> next_file(0);
+        std::mutex cerr_mutex;
+
+        const auto worker = [&]() {
+            TreeStats stats;
+            for(size_t n = next_file++; n < file_names.size(); n = next_file++) {
+                try {
+                    auto file = root_ext::OpenRootFile(file_names.at(n));
+                    std::unique_ptr<TTree> tree(root_ext::ReadObject<TTree>(*file, args.treeName()));
+                    stats += TreeStats(*tree);
+                } catch(exception& e) {
+                    std::lock_guard<std::mutex> lock(cerr_mutex);
+                    std::cerr << file_names.at(n) << ": " << e.what() << std::endl;
+                }
+            }
+            return stats;
+        };
+
+        if(n_workers == 1)
+            return worker();
+
+        ROOT::EnableThreadSafety();
+        std::vector<std::future<TreeStats>> results;
+        for(size_t n = 0; n < n_workers; ++n)
+            results.push_back(std::async(std::launch::async, worker));
+        TreeStats total;
+        for(auto& result : results)
+            total += result.get();
+        return total;
+    }
+
+    // Baskets are re-compressed in a single thread using the first input file, so that the measured throughput
+    // is not affected by the other workers. The suggested setting is the one with the smallest estimated time
+    // to read the branch, i.e. the time to fetch the compressed data with ioBandwidth plus the decompression time.
+    void RunCompressionBenchmark(const std::vector<const BranchStats*>& branches) const
+    {
+        using CompressionBenchmark = root_ext::CompressionBenchmark;
+        using CompressionSetting = root_ext::CompressionSetting;
+        using Result = root_ext::CompressionBenchmarkResult;
+
+        const std::string& file_name = file_names.front();
+        auto file = root_ext::OpenRootFile(file_name);
+        std::unique_ptr<TTree> tree(root_ext::ReadObject<TTree>(*file, args.treeName()));
+        const CompressionBenchmark benchmark(args.benchmarkBaskets());
+        const double io_bandwidth = args.ioBandwidth();
+        const auto faster = [&](const Result& r1, const Result& r2) {
+            return r1.ReadTime(io_bandwidth) < r2.ReadTime(io_bandwidth);
+        };
+
+        std::vector<Result> total;
+        for(const auto& setting : CompressionBenchmark::DefaultSettings())
+            total.emplace_back(setting);
+
+        std::cout << boost::format("\nCompression benchmark: file = %1%, baskets per branch <= %2%, "
+                                   "I/O bandwidth = %3% MB/s.\n") % file_name % args.benchmarkBaskets()
+                     % io_bandwidth;
+        std::cout << boost::format("%|-30| %|-12| %|-12| %|-14| %|-12| %|-12|\n") % "Name" % "Current"
+                     % "Comp." % "Suggested" % "Comp." % "Read s/GB";
+        for(const BranchStats* branch_stats : branches) {
+            TBranch* branch = tree->GetBranch(branch_stats->name.c_str());
+            if(!branch) continue;
+            auto results = benchmark.Run(*branch);
+            if(results.empty() || !results.front().raw_size) continue;
+            for(size_t n = 0; n < results.size(); ++n)
+                total.at(n) += results.at(n);
+            const Result& best = *std::min_element(results.begin(), results.end(), faster);
+            const int current = branch->GetCompressionSettings() >= 0 ? branch->GetCompressionSettings()
+                                                                      : file->GetCompressionSettings();
+            std::cout << boost::format("%|-30| %|-12| %|-12.2f| %|-14| %|-12.2f| %|-12.2f|\n")
+                         % branch_stats->name % CompressionSetting::ToString(current)
+                         % branch_stats->CompressionFactor() % best.setting.ToString() % best.CompressionFactor()
+                         % best.ReadTime(io_bandwidth);
+        }
+
+        std::sort(total.begin(), total.end(), faster);
+        std::cout << "\nRanking of the compression settings for all branches:\n"
+                  << boost::format("%|-6| %|-12| %|-12| %|-16| %|-16| %|-12|\n") % "Rank" % "Setting" % "Comp."
+                     % "Compress MB/s" % "Decompress MB/s" % "Read s/GB";
+        for(size_t n = 0; n < total.size(); ++n) {
+            const Result& result = total.at(n);
+            std::cout << boost::format("%|-6| %|-12| %|-12.2f| %|-16.1f| %|-16.1f| %|-12.2f|\n") % (n + 1)
+                         % result.setting.ToString() % result.CompressionFactor() % result.CompressSpeed()
+                         % result.DecompressSpeed() % result.ReadTime(io_bandwidth);
+        }
+        std::cout << std::flush;
+    }
+
+    static const std::vector<int>& StatColumnWidths()
+    {
+        static const std::vector<int> column_widths = { 30, 14, 10, 14, 10, 10, 14, 14, 30 };
+        return column_widths;
+    }
+
+    static void PrintStatsHeader(std::ostream& s)
+    {
+        const auto& widths = StatColumnWidths();
+        s << std::left
+          << std::setw(widths.at(0)) << "Name"
+          << std::setw(widths.at(1)) << "Zip size"
+          << std::setw(widths.at(2)) << "% Total"
+          << std::setw(widths.at(3)) << "Raw size"
+          << std::setw(widths.at(4)) << "Comp."
+          << std::setw(widths.at(5)) << "Baskets"
+          << std::setw(widths.at(6)) << "Avg basket"
+          << std::setw(widths.at(7)) << "Entries/bask."
+          << std::setw(widths.at(8)) << "Class"
+          << std::endl;
+    }
+
+    static void PrintStats(std::ostream& s, const BranchStats& branch, Long64_t total_zip_size)
+    {
+        const auto& widths = StatColumnWidths();
+        s << std::left << std::fixed << std::setprecision(2)
+          << std::setw(widths.at(0)) << branch.name
+          << std::setw(widths.at(1)) << branch.zip_size
+          << std::setw(widths.at(2)) << double(branch.zip_size) / total_zip_size * 100.0
+          << std::setw(widths.at(3)) << branch.raw_size
+          << std::setw(widths.at(4)) << branch.CompressionFactor()
+          << std::setw(widths.at(5)) << branch.n_baskets
+          << std::setw(widths.at(6)) << branch.AverageBasketSize()
+          << std::setw(widths.at(7)) << branch.EntriesPerBasket()
+          << std::setw(widths.at(8)) << branch.class_name
+          << std::endl;
     }
 
 private:
-    std::shared_ptr<TFile> file;
-    std::shared_ptr<TTree> tree;
+    Arguments args;
     BranchOrdering ordering;
+    std::vector<std::string> file_names;
 };
 
 PROGRAM_MAIN(DumpBranchStats, Arguments)
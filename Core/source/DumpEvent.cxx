@@ -1,22 +1,27 @@
 /*! Dump all variables in the event.
 This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 
+#include <fstream>
 #include <iostream>
 
+#include <boost/algorithm/string.hpp>
 #include <TTree.h>
 #include "RootExt.h"
 #include "AnalysisTools/Run/include/program_main.h"
 #include "AnalysisTools/Core/include/EventIdentifier.h"
+#include "AnalysisTools/Core/include/EventIndex.h"
 #include "AnalysisTools/Core/include/SmartBranch.h"
 
 struct Arguments {
     REQ_ARG(std::string, fileName);
     REQ_ARG(std::string, treeName);
-    REQ_ARG(std::string, eventId);
+    OPT_ARG(std::string, eventId, "");
+    OPT_ARG(std::string, eventIdFile, "");
     OPT_ARG(Long64_t, firstEntry, 0);
     OPT_ARG(Long64_t, lastEntry, std::numeric_limits<Long64_t>::max());
     OPT_ARG(size_t, maxMatches, std::numeric_limits<size_t>::max());
     OPT_ARG(std::string, eventIdBranches, "run:lumi:evt");
+    OPT_ARG(bool, useIndex, true);
 };
 
 class DumpEvent {
@@ -24,69 +29,163 @@ public:
     using exception = analysis::exception;
     using EventIdentifier = analysis::EventIdentifier;
     using SmartBranch = root_ext::SmartBranch;
+    using EventIndex = analysis::EventIndex;
+    using EventIdSet = std::set<EventIdentifier>;
+    using EventMatchMap = std::map<EventIdentifier, size_t>;
+    using EntryList = std::vector<std::pair<Long64_t, EventIdentifier>>;
 
     DumpEvent(const Arguments& _args) :
-        args(_args),
-        file(root_ext::OpenRootFile(args.fileName())),
-        tree(root_ext::ReadObject<TTree>(*file, args.treeName())),
-        selectedEventId(args.eventId())
+        args(_args), eventIdentifierBranches(EventIdentifier::Split(args.eventIdBranches()))
     {
-        const auto eventIdentifierBranches = EventIdentifier::Split(args.eventIdBranches());
-        for(const auto& name : eventIdentifierBranches) {
-            SmartBranch branch(*tree, name);
-            branch.Enable();
-            idBranches.push_back(branch);
-        }
+        boost::split(fileNames, args.fileName(), boost::is_any_of(","), boost::token_compress_on);
+        LoadEventIds();
+        if(selectedEventIds.empty())
+            throw exception("No event ids to look for are specified. Use eventId and/or eventIdFile.");
     }
 
     void Run()
+    {
+        EventMatchMap nMatches;
+        for(const auto& fileName : fileNames) {
+            if(fileNames.size() > 1)
+                std::cout << "file " << fileName << std::endl;
+            ProcessFile(fileName, nMatches);
+        }
+
+        std::vector<EventIdentifier> notFound;
+        for(const auto& eventId : selectedEventIds) {
+            if(!nMatches.count(eventId))
+                notFound.push_back(eventId);
+        }
+        if(notFound.size() == selectedEventIds.size()) {
+            if(selectedEventIds.size() == 1)
+                throw exception("Event %1% not found.") % *selectedEventIds.begin();
+            throw exception("None of the %1% events are found.") % selectedEventIds.size();
+        }
+        for(const auto& eventId : notFound)
+            std::cerr << "Event " << eventId << " not found." << std::endl;
+    }
+
+private:
+    void LoadEventIds()
+    {
+        std::vector<std::string> idStrings;
+        if(!args.eventId().empty())
+            boost::split(idStrings, args.eventId(), boost::is_any_of(","), boost::token_compress_on);
+        if(!args.eventIdFile().empty()) {
+            std::ifstream idFile(args.eventIdFile());
+            if(idFile.fail())
+                throw exception("Unable to open the event id file '%1%'.") % args.eventIdFile();
+            std::string line;
+            while(std::getline(idFile, line)) {
+                const size_t commentPos = line.find('#');
+                if(commentPos != std::string::npos)
+                    line.erase(commentPos);
+                boost::trim(line);
+                if(!line.empty())
+                    idStrings.push_back(line);
+            }
+        }
+        for(const auto& idString : idStrings) {
+            if(!idString.empty())
+                selectedEventIds.insert(EventIdentifier(idString));
+        }
+    }
+
+    void ProcessFile(const std::string& fileName, EventMatchMap& nMatches) const
     {
         static const std::string sep(10, '-');
-        std::vector<Long64_t> entries = FindEntries();
-        if(!entries.size())
-            throw exception("Event %1% not found.") % selectedEventId;
-        const auto branch_names = SmartBranch::CollectBranchNames(*tree);
-        for(Long64_t entry : entries) {
-            std::cout << sep << " entry " << entry << " START " << sep << std::endl;
-            for(const std::string& name : branch_names) {
-                try {
-                    SmartBranch branch(*tree, name);
-                    branch.Enable();
-                    branch->GetEntry(entry);
-                    branch.PrintValue(std::cout);
-                } catch(exception& e) {
-                    std::cerr << e.what() << std::endl;
-                }
+
+        auto file = root_ext::OpenRootFile(fileName);
+        auto tree = root_ext::ReadObject<TTree>(*file, args.treeName());
+        std::shared_ptr<EventIndex> index;
+        if(args.useIndex())
+            index = EventIndex::TryOpen(file, args.treeName(), eventIdentifierBranches);
+
+        const EntryList entries = index ? FindEntries(*index, nMatches) : FindEntries(*tree, nMatches);
+        if(entries.empty()) return;
+
+        // Readers are created once per file and reused for all matched entries.
+        std::vector<SmartBranch> branches;
+        for(const std::string& name : SmartBranch::CollectBranchNames(*tree)) {
+            try {
+                SmartBranch branch(*tree, name);
+                branch.Enable();
+                branches.push_back(branch);
+            } catch(exception& e) {
+                std::cerr << e.what() << std::endl;
             }
-            std::cout << sep << " entry " << entry << " END " << sep << std::endl;
+        }
+
+        for(const auto& entry : entries) {
+            std::cout << sep << " entry " << entry.first << " START " << sep << std::endl;
+            for(auto& branch : branches) {
+                branch->GetEntry(entry.first);
+                branch.PrintValue(std::cout);
+            }
+            std::cout << sep << " entry " << entry.first << " END " << sep << std::endl;
         }
     }
 
-private:
-    std::vector<Long64_t> FindEntries() const
+    bool IsSelected(Long64_t entry) const { return entry >= args.firstEntry() && entry < args.lastEntry(); }
+
+    bool AddMatch(Long64_t entry, const EventIdentifier& eventId, EventMatchMap& nMatches, EntryList& entries) const
     {
-        std::vector<Long64_t> entries;
-        const Long64_t n_max = std::min(tree->GetEntries(), args.lastEntry());
-        for(Long64_t n = args.firstEntry(); n < n_max; ++n) {
+        size_t& n = nMatches[eventId];
+        if(n >= args.maxMatches()) return false;
+        ++n;
+        entries.emplace_back(entry, eventId);
+        return true;
+    }
 
-            tree->GetEntry(n);
+    EntryList FindEntries(const EventIndex& index, EventMatchMap& nMatches) const
+    {
+        EntryList entries;
+        for(const auto& eventId : selectedEventIds) {
+            for(Long64_t entry : index.FindEntries(eventId, std::numeric_limits<size_t>::max())) {
+                if(IsSelected(entry) && !AddMatch(entry, eventId, nMatches, entries)) break;
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+        return entries;
+    }
+
+    // Linear scan that reads only the event id branches.
+    EntryList FindEntries(TTree& tree, EventMatchMap& nMatches) const
+    {
+        std::vector<SmartBranch> idBranches;
+        for(const auto& name : eventIdentifierBranches) {
+            SmartBranch branch(tree, name);
+            branch.Enable();
+            idBranches.push_back(branch);
+        }
+
+        EntryList entries;
+        size_t nCompleted = 0;
+        for(const auto& eventId : selectedEventIds) {
+            if(nMatches.count(eventId) && nMatches.at(eventId) >= args.maxMatches())
+                ++nCompleted;
+        }
+
+        const Long64_t n_max = std::min(tree.GetEntries(), args.lastEntry());
+        for(Long64_t n = args.firstEntry(); n < n_max && nCompleted < selectedEventIds.size(); ++n) {
+            for(auto& branch : idBranches)
+                branch->GetEntry(n);
             const EventIdentifier currentEventId(idBranches.at(0).GetValue<EventIdentifier::IdType>(),
                                                  idBranches.at(1).GetValue<EventIdentifier::IdType>(),
                                                  idBranches.at(2).GetValue<EventIdentifier::IdType>());
-            if(currentEventId == selectedEventId) {
-                entries.push_back(n);
-                if(entries.size() >= args.maxMatches()) break;
-            }
+            if(!selectedEventIds.count(currentEventId)) continue;
+            if(AddMatch(n, currentEventId, nMatches, entries) && nMatches.at(currentEventId) == args.maxMatches())
+                ++nCompleted;
         }
         return entries;
     }
 
 private:
     Arguments args;
-    std::shared_ptr<TFile> file;
-    std::shared_ptr<TTree> tree;
-    std::vector<SmartBranch> idBranches;
-    EventIdentifier selectedEventId;
+    std::vector<std::string> fileNames;
+    std::vector<std::string> eventIdentifierBranches;
+    EventIdSet selectedEventIds;
 };
 
 PROGRAM_MAIN(DumpEvent, Arguments)
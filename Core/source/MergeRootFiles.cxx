@@ -1,6 +1,11 @@
 /*! Merge multiple root files into a single file.
 This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include "AnalysisTools/Core/include/MergeManifest.h"
 #include "AnalysisTools/Core/include/RootFilesMerger.h"
 #include "AnalysisTools/Run/include/program_main.h"
 
@@ -13,21 +18,148 @@ struct Arguments {
     run::Argument<std::string> exclude_dir_list{"exclude-dir-list",
                                                 "comma separated list of directories to exclude", ""};
     run::Argument<unsigned> n_threads{"n-threads", "number of threads", 1};
+    run::Argument<bool> fast_tree_merge{"fast-tree-merge", "copy compressed tree baskets without recompression",
+                                        false};
+    run::Argument<size_t> memory_budget{"memory-budget",
+                                        "memory budget for histograms in MB, 0 means no limit", 0};
+    run::Argument<bool> incremental{"incremental",
+                                    "merge only the inputs that are not listed in the manifest of the output", false};
+    // The inputs are split into shards with a power-of-two number of files, so fewer processes can be started than
+    // requested: e.g. 5000 files with 64 processes give shards of 128 files and only 40 worker processes.
+    run::Argument<unsigned> n_processes{"n-processes", "maximal number of worker processes", 1};
 };
 
-class MergeRootFiles : public analysis::RootFilesMerger {
+class MergeRootFiles {
 public:
-    MergeRootFiles(const Arguments& args) :
-        RootFilesMerger(args.output(), args.input_dirs(), args.file_name_pattern(), args.exclude_list(),
-                        args.exclude_dir_list(), args.n_threads(), ROOT::kZLIB, 9)
+    using RootFilesMerger = analysis::RootFilesMerger;
+    using MergeManifest = analysis::MergeManifest;
+
+    MergeRootFiles(const Arguments& _args) : args(_args) {}
+
+    void Run()
     {
+        const auto input_files = RootFilesMerger::FindInputFiles(args.input_dirs(), args.file_name_pattern(),
+                                                                 args.exclude_list(), args.exclude_dir_list());
+        if(!args.incremental()) {
+            Merge(args.output(), input_files);
+            return;
+        }
+
+        MergeManifest manifest(args.output());
+        manifest.Recover();
+        const auto new_files = manifest.SelectNewInputs(input_files);
+        if(new_files.empty()) {
+            std::cout << "All " << input_files.size() << " input files are already merged." << std::endl;
+            return;
+        }
+        std::cout << "Merging " << new_files.size() << " new input files out of " << input_files.size() << "."
+                  << std::endl;
+
+        // The previous output goes first, so that it takes the place of the already merged inputs.
+        std::vector<std::string> files_to_merge;
+        if(manifest.HasOutput())
+            files_to_merge.push_back(manifest.GetOutput());
+        files_to_merge.insert(files_to_merge.end(), new_files.begin(), new_files.end());
+        Merge(manifest.GetTemporaryOutput(), files_to_merge);
+        manifest.Commit();
     }
 
-    void Run()
+private:
+    void Merge(const std::string& output, const std::vector<std::string>& input_files) const
+    {
+        if(args.n_processes() > 1 && input_files.size() > 1)
+            MergeSharded(output, input_files);
+        else
+            MergeFiles(output, input_files);
+    }
+
+    // The inputs are split into contiguous shards with a power-of-two size, so that each shard corresponds to
+    // a complete subtree of the histogram merge tree of RootFilesMerger. Merging the shard outputs in the shard
+    // order therefore reproduces exactly the same sequence of histogram additions for any number of processes,
+    // and the tree entries keep the input order.
+    void MergeSharded(const std::string& output, const std::vector<std::string>& input_files) const
+    {
+        const size_t n_files = input_files.size();
+        const size_t min_shard_size = (n_files + args.n_processes() - 1) / args.n_processes();
+        size_t shard_size = 1;
+        while(shard_size < min_shard_size)
+            shard_size *= 2;
+
+        ShardCleanup cleanup;
+        auto& shard_outputs = cleanup.shard_outputs;
+        auto& workers = cleanup.workers;
+        std::cout << std::flush;
+        for(size_t first = 0; first < n_files; first += shard_size) {
+            const std::string shard_output = output + ".shard" + std::to_string(shard_outputs.size()) + ".root";
+            const std::vector<std::string> shard_files(input_files.begin() + first,
+                                                       input_files.begin() + std::min(first + shard_size, n_files));
+            shard_outputs.push_back(shard_output);
+            const pid_t pid = fork();
+            if(pid < 0)
+                throw analysis::exception("Unable to start a worker process.");
+            if(pid == 0)
+                RunWorker(shard_output, shard_files);
+            workers.push_back(pid);
+        }
+
+        size_t n_failed = 0;
+        const size_t n_workers = workers.size();
+        for(pid_t pid : workers) {
+            int status = 0;
+            if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                ++n_failed;
+        }
+        workers.clear();
+        if(n_failed)
+            throw analysis::exception("%1% out of %2% worker processes failed.") % n_failed % n_workers;
+
+        std::cout << "Combining " << shard_outputs.size() << " shards..." << std::endl;
+        MergeFiles(output, shard_outputs);
+    }
+
+    // Stops the worker processes that are still running and removes the shard outputs on any exit path.
+    // The worker processes leave with _exit, so they never run it.
+    struct ShardCleanup {
+        std::vector<pid_t> workers;
+        std::vector<std::string> shard_outputs;
+
+        ~ShardCleanup()
+        {
+            for(pid_t pid : workers) {
+                kill(pid, SIGKILL);
+                waitpid(pid, nullptr, 0);
+            }
+            for(const auto& shard_output : shard_outputs) {
+                boost::system::error_code error;
+                boost::filesystem::remove(shard_output, error);
+            }
+        }
+    };
+
+    [[noreturn]] void RunWorker(const std::string& output, const std::vector<std::string>& input_files) const
     {
-        Process(true, true);
+        int exit_code = 0;
+        try {
+            MergeFiles(output, input_files);
+        } catch(std::exception& e) {
+            std::cerr << "ERROR in the worker for '" << output << "': " << e.what() << std::endl;
+            exit_code = 1;
+        }
+        std::cout << std::flush;
+        std::cerr << std::flush;
+        _exit(exit_code);
     }
+
+    void MergeFiles(const std::string& output, const std::vector<std::string>& input_files) const
+    {
+        RootFilesMerger merger(output, input_files, args.n_threads(), ROOT::kZLIB, 9);
+        merger.SetFastTreeMerge(args.fast_tree_merge());
+        merger.SetMemoryBudget(args.memory_budget() * 1024 * 1024);
+        merger.Process(true, true);
+    }
+
+private:
+    Arguments args;
 };
 
 PROGRAM_MAIN(MergeRootFiles, Arguments)
-
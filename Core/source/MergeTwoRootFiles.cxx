@@ -3,6 +3,7 @@ Some parts of the code are taken from copyFile.C written by Rene Brun.
 This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 
 #include <iostream>
+#include <unordered_set>
 
 #include <TROOT.h>
 #include <TKey.h>
@@ -28,57 +29,74 @@ public:
     void Run()
     {
         std::cout << "Copying original file..." << std::endl;
-        CopyDirectory(originalFile.get(), outputFile.get(), false);
+        root_ext::RawKeyCopier originalCopier(*originalFile);
+        CopyDirectory(originalFile.get(), outputFile.get(), false, originalCopier);
         std::cout << "Copying reference file..." << std::endl;
-        CopyDirectory(referenceFile.get(), outputFile.get(), true);
+        root_ext::RawKeyCopier referenceCopier(*referenceFile);
+        CopyDirectory(referenceFile.get(), outputFile.get(), true, referenceCopier);
         std::cout << "Original and reference files has been merged." << std::endl;
     }
 
 private:
     /// Copy all objects and subdirs of the source directory to the destination directory.
-    static void CopyDirectory(TDirectory *source, TDirectory *destination, bool isReference)
+    /// Trees are cloned basket by basket and all other objects are copied as raw keys, so nothing except
+    /// the directories is deserialized.
+    static void CopyDirectory(TDirectory *source, TDirectory *destination, bool isReference,
+                              root_ext::RawKeyCopier& copier)
     {
         std::cout<< "CopyDir. Current direcotry: " << destination->GetName() << std::endl;
 
+        std::unordered_set<std::string> destinationKeys;
+        TIter nextDestinationKey(destination->GetListOfKeys());
+        for(TKey* key; (key = dynamic_cast<TKey*>(nextDestinationKey()));)
+            destinationKeys.insert(key->GetName());
+
         TIter nextkey(source->GetListOfKeys());
         for(TKey* key; (key = dynamic_cast<TKey*>(nextkey()));) {
             //std::cout << "Processing key: " << key->GetName() << std::endl;
+            const std::string name = key->GetName();
             const char *classname = key->GetClassName();
             TClass *cl = gROOT->GetClass(classname);
             if (!cl) continue;
             bool objectWritten = false;
             if (cl->InheritsFrom("TDirectory")) {
-                TDirectory *subdir_source = static_cast<TDirectory*>(source->Get(key->GetName()));
+                TDirectory *subdir_source = static_cast<TDirectory*>(source->Get(name.c_str()));
                 TDirectory *subdir_destination;
                 if(isReference) {
-                    subdir_destination = static_cast<TDirectory*>(destination->Get(subdir_source->GetName()));
+                    subdir_destination = destinationKeys.count(name) ? destination->GetDirectory(name.c_str())
+                                                                     : nullptr;
                     if(!subdir_destination) {
-                        std::cout << "Skipping reference directory '" << subdir_source->GetName()
+                        std::cout << "Skipping reference directory '" << name
                                   << "', which is missing in the origin file.";
                         continue;
                     }
 
-                } else
-                    subdir_destination = destination->mkdir(subdir_source->GetName());
+                } else {
+                    subdir_destination = destination->mkdir(name.c_str());
+                    destinationKeys.insert(name);
+                }
 
-                CopyDirectory(subdir_source, subdir_destination, isReference);
-            } else if(destination->Get(key->GetName())) {
+                CopyDirectory(subdir_source, subdir_destination, isReference, copier);
+            } else if(destinationKeys.count(name)) {
 
             } else if (cl->InheritsFrom("TTree")) {
-                TTree *T = root_ext::ReadObject<TTree>(*source, key->GetName());
-                TTree *newT = T->CloneTree();
-                destination->WriteTObject(newT, key->GetName(), "WriteDelete");
+                std::unique_ptr<TTree> T(root_ext::ReadObject<TTree>(*source, name));
+                destination->cd();
+                TTree *newT = T->CloneTree(-1, "fast");
+                destination->WriteTObject(newT, name.c_str(), "WriteDelete");
+                delete newT;
                 objectWritten = true;
             } else {
-                std::unique_ptr<TObject> original_obj(key->ReadObj());
-                std::unique_ptr<TObject> obj(original_obj->Clone());
-                destination->WriteTObject(obj.get(), key->GetName(), "WriteDelete");
+                copier.Copy(*key, *destination);
                 objectWritten = true;
             }
 
-            if(objectWritten && isReference)
-                std::cout << "Object '" << key->GetName() << "' taken from the reference file for '"
-                          << destination->GetName()  << "'" << std::endl;
+            if(objectWritten) {
+                destinationKeys.insert(name);
+                if(isReference)
+                    std::cout << "Object '" << name << "' taken from the reference file for '"
+                              << destination->GetName()  << "'" << std::endl;
+            }
         }
         destination->SaveSelf(kTRUE);
     }
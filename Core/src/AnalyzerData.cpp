@@ -3,33 +3,40 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 
 #include "AnalysisTools/Core/include/AnalyzerData.h"
 
+#include <map>
+#include <mutex>
 #include <vector>
 #include <unordered_map>
 #include <utility>
 #include "AnalysisTools/Core/include/RootExt.h"
 #include "AnalysisTools/Core/include/TextIO.h"
 #include "AnalysisTools/Core/include/SmartHistogram.h"
+#include "AnalysisTools/Core/include/ParallelObjectWriter.h"
 
 namespace root_ext {
 
 AnalyzerDataEntryBase::AnalyzerDataEntryBase(const std::string& _name, AnalyzerData* _data)
-    : name(_name), data(_data)
+    : name(_name), data(_data), uid(detail::AcquireUid())
 {
     data->AddEntry(*this);
 }
+
+AnalyzerDataEntryBase::~AnalyzerDataEntryBase() { detail::ReleaseUid(uid); }
+
 const std::string& AnalyzerDataEntryBase::Name() const { return name; }
 AnalyzerDataEntryBase::Mutex& AnalyzerDataEntryBase::GetMutex() { return mutex; }
 
 
-AnalyzerData::AnalyzerData() : directory(nullptr), readMode(false), mutex(std::make_unique<Mutex>()) {}
+AnalyzerData::AnalyzerData() :
+    directory(nullptr), readMode(false), mutex(std::make_unique<Mutex>()), uid(detail::AcquireUid()) {}
 
 AnalyzerData::AnalyzerData(const std::string& outputFileName) :
     outputFile(CreateRootFile(outputFileName)), directory(outputFile.get()), readMode(false),
-    mutex(std::make_unique<Mutex>()) {}
+    mutex(std::make_unique<Mutex>()), uid(detail::AcquireUid()) {}
 
 AnalyzerData::AnalyzerData(std::shared_ptr<TFile> _outputFile, const std::string& directoryName,
                            bool _readMode) :
-    outputFile(_outputFile), readMode(_readMode), mutex(std::make_unique<Mutex>())
+    outputFile(_outputFile), readMode(_readMode), mutex(std::make_unique<Mutex>()), uid(detail::AcquireUid())
 {
     if(!outputFile)
         throw analysis::exception("Output file is nullptr.");
@@ -37,7 +44,7 @@ AnalyzerData::AnalyzerData(std::shared_ptr<TFile> _outputFile, const std::string
 }
 
 AnalyzerData::AnalyzerData(TDirectory* _directory, const std::string& subDirectoryName, bool _readMode) :
-    readMode(_readMode), mutex(std::make_unique<Mutex>())
+    readMode(_readMode), mutex(std::make_unique<Mutex>()), uid(detail::AcquireUid())
 {
     if(!_directory)
         throw analysis::exception("Output directory is nullptr.");
@@ -46,16 +53,17 @@ AnalyzerData::AnalyzerData(TDirectory* _directory, const std::string& subDirecto
 
 AnalyzerData::~AnalyzerData()
 {
-    if(directory && !readMode) {
-        for(const auto& hist : histograms)
-            hist.second->WriteRootObject();
-    }
+    if(directory && !readMode)
+        WriteHistograms();
+    detail::ReleaseUid(uid);
 }
 
 TDirectory* AnalyzerData::GetOutputDirectory() const { return directory; }
 std::shared_ptr<TFile> AnalyzerData::GetOutputFile() const { return outputFile; }
 bool AnalyzerData::ReadMode() const { return readMode; }
 AnalyzerData::Mutex& AnalyzerData::GetMutex() const { return *mutex; }
+size_t AnalyzerData::GetNumberOfWriteThreads() const { return nWriteThreads; }
+void AnalyzerData::SetNumberOfWriteThreads(size_t n_threads) { nWriteThreads = std::max<size_t>(n_threads, 1); }
 
 void AnalyzerData::AddHistogram(HistPtr hist)
 {
@@ -79,4 +87,76 @@ void AnalyzerData::AddEntry(Entry& entry)
 }
 const AnalyzerData::EntryContainer& AnalyzerData::GetEntries() const { return entries; }
 
+void AnalyzerData::EnableSharding(bool enable) { sharded = enable; }
+bool AnalyzerData::IsSharded() const { return sharded; }
+
+namespace {
+using ThreadShardIndices = detail::ThreadUidTable<size_t>;
+ThreadShardIndices& GetThreadShardIndices()
+{
+    static thread_local ThreadShardIndices indices;
+    return indices;
+}
+} // anonymous namespace
+
+void AnalyzerData::SetThreadShardIndex(size_t index)
+{
+    std::lock_guard<Mutex> lock(*mutex);
+    auto& indices = GetThreadShardIndices();
+    if(indices.Find(uid))
+        throw analysis::exception("The shard index of the thread is already set.");
+    if(!shardIndices.insert(index).second)
+        throw analysis::exception("Shard %1% is already used by another thread.") % index;
+    indices[uid] = index;
+}
+
+size_t AnalyzerData::GetThreadShardIndex()
+{
+    auto& indices = GetThreadShardIndices();
+    if(const size_t* index = indices.Find(uid))
+        return *index;
+    std::lock_guard<Mutex> lock(*mutex);
+    const size_t index = shardIndices.empty() ? 0 : *shardIndices.rbegin() + 1;
+    shardIndices.insert(index);
+    indices[uid] = index;
+    return index;
+}
+
+// The entries take their own lock and then the lock of AnalyzerData to add new histograms, so the lock of
+// AnalyzerData is released before the entries are merged to keep the same lock order.
+void AnalyzerData::MergeShards()
+{
+    std::vector<Entry*> entries_to_merge;
+    {
+        std::lock_guard<Mutex> lock(*mutex);
+        for(const auto& entry : entries)
+            entries_to_merge.push_back(entry.second);
+    }
+    for(Entry* entry : entries_to_merge)
+        entry->MergeShards();
+}
+
+// Histograms that are stored as is are serialized in parallel and written in the order of their names.
+// Objects that are created only at the moment of writing are written one by one.
+void AnalyzerData::WriteHistograms()
+{
+    std::lock_guard<Mutex> lock(*mutex);
+    if(nWriteThreads <= 1) {
+        for(const auto& hist : histograms)
+            hist.second->WriteRootObject();
+        return;
+    }
+
+    const std::map<std::string, HistPtr> ordered_histograms(histograms.begin(), histograms.end());
+    std::vector<const TObject*> objects;
+    for(const auto& hist : ordered_histograms) {
+        const TObject* object = hist.second->GetRootObject();
+        if(object && hist.second->GetOutputDirectory() == directory)
+            objects.push_back(object);
+        else
+            hist.second->WriteRootObject();
+    }
+    WriteObjectsParallel(*directory, objects, nWriteThreads);
+}
+
 } // root_ext
@@ -0,0 +1,115 @@
+/*! Measure the compression ratio and speed of the branch data for different compression settings.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include "AnalysisTools/Core/include/CompressionBenchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <TBasket.h>
+#include <TBuffer.h>
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace {
+double ElapsedSeconds(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double Speed(Long64_t size, double time)
+{
+    return time > 0 ? size / time / 1024. / 1024. : 0;
+}
+}
+
+namespace root_ext {
+
+CompressionBenchmarkResult::CompressionBenchmarkResult(const CompressionSetting& _setting) : setting(_setting) {}
+
+double CompressionBenchmarkResult::CompressionFactor() const { return zip_size ? double(raw_size) / zip_size : 0; }
+double CompressionBenchmarkResult::CompressSpeed() const { return Speed(raw_size, compress_time); }
+double CompressionBenchmarkResult::DecompressSpeed() const { return Speed(raw_size, decompress_time); }
+
+double CompressionBenchmarkResult::ReadTime(double io_bandwidth) const
+{
+    if(!raw_size) return 0;
+    const double raw_mb = 1024.;
+    const double zip_mb = raw_mb / CompressionFactor();
+    const double decompress_speed = DecompressSpeed();
+    return zip_mb / io_bandwidth + (decompress_speed > 0 ? raw_mb / decompress_speed : 0);
+}
+
+CompressionBenchmarkResult& CompressionBenchmarkResult::operator+=(const CompressionBenchmarkResult& other)
+{
+    if(other.setting.Settings() != setting.Settings())
+        throw analysis::exception("Can't add benchmark results for different compression settings %1% and %2%.")
+            % setting.ToString() % other.setting.ToString();
+    raw_size += other.raw_size;
+    zip_size += other.zip_size;
+    compress_time += other.compress_time;
+    decompress_time += other.decompress_time;
+    return *this;
+}
+
+const std::vector<CompressionSetting>& CompressionBenchmark::DefaultSettings()
+{
+    static const std::vector<CompressionSetting> settings = {
+        { ROOT::kZLIB, 1 }, { ROOT::kZLIB, 4 }, { ROOT::kZLIB, 6 }, { ROOT::kZLIB, 9 },
+        { ROOT::kLZ4, 1 }, { ROOT::kLZ4, 4 }, { ROOT::kLZ4, 9 },
+        { ROOT::kZSTD, 1 }, { ROOT::kZSTD, 5 }, { ROOT::kZSTD, 9 },
+        { ROOT::kLZMA, 1 }, { ROOT::kLZMA, 5 }, { ROOT::kLZMA, 9 },
+    };
+    return settings;
+}
+
+CompressionBenchmark::CompressionBenchmark(size_t _max_baskets, const std::vector<CompressionSetting>& _settings) :
+    max_baskets(_max_baskets), settings(_settings)
+{
+}
+
+CompressionBenchmark::ResultCollection CompressionBenchmark::Run(TBranch& branch) const
+{
+    std::vector<Buffer> baskets;
+    CollectBaskets(branch, baskets);
+
+    ResultCollection results;
+    for(const auto& setting : settings) {
+        CompressionBenchmarkResult result(setting);
+        for(const auto& basket : baskets) {
+            auto start = std::chrono::steady_clock::now();
+            const Buffer zip_data = CompressBuffer(basket, setting);
+            result.compress_time += ElapsedSeconds(start);
+
+            start = std::chrono::steady_clock::now();
+            const Buffer raw_data = DecompressBuffer(zip_data, basket.size());
+            result.decompress_time += ElapsedSeconds(start);
+
+            if(raw_data != basket)
+                throw analysis::exception("%1%: compression round trip with %2% failed.") % branch.GetName()
+                    % setting.ToString();
+            result.raw_size += static_cast<Long64_t>(basket.size());
+            result.zip_size += static_cast<Long64_t>(zip_data.size());
+        }
+        results.push_back(result);
+    }
+    return results;
+}
+
+void CompressionBenchmark::CollectBaskets(TBranch& branch, std::vector<Buffer>& baskets) const
+{
+    const Int_t n_baskets = branch.GetWriteBasket();
+    const size_t n_samples = std::min<size_t>(max_baskets, static_cast<size_t>(n_baskets));
+    for(size_t n = 0; n < n_samples; ++n) {
+        const Int_t basket_id = static_cast<Int_t>(n * static_cast<size_t>(n_baskets) / n_samples);
+        TBasket* basket = branch.GetBasket(basket_id);
+        if(!basket || basket->GetObjlen() <= 0) continue;
+        const char* data = basket->GetBufferRef()->Buffer() + basket->GetKeylen();
+        baskets.emplace_back(data, data + basket->GetObjlen());
+    }
+    branch.DropBaskets("all");
+
+    auto sub_branches = branch.GetListOfBranches();
+    for(auto sub_branch : *sub_branches)
+        CollectBaskets(*dynamic_cast<TBranch*>(sub_branch), baskets);
+}
+
+} // namespace root_ext
@@ -0,0 +1,190 @@
+/*! Definition of a persistent index that maps event identifiers to tree entries.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include "AnalysisTools/Core/include/EventIndex.h"
+
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <boost/algorithm/string/join.hpp>
+#include <boost/filesystem.hpp>
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "AnalysisTools/Core/include/SmartTree.h"
+
+namespace {
+using IdType = analysis::EventIdentifier::IdType;
+
+constexpr const char* SourceIdName = "source_id";
+
+// The column is read basket by basket, so that the bulk reads always start at a basket boundary.
+template<typename T>
+void ReadIdColumn(TTree& tree, TBranch& branch, std::vector<IdType>& ids)
+{
+    T value;
+    root_ext::detail::EnableBranch(branch);
+    tree.SetBranchAddress(branch.GetName(), &value);
+    const Long64_t n_entries = tree.GetEntries();
+    ids.reserve(static_cast<size_t>(n_entries));
+    const Long64_t* basket_entries = branch.GetBasketEntry();
+    const Int_t n_baskets = branch.GetWriteBasket();
+    std::vector<T> values;
+    for(Int_t basket = 0; basket <= n_baskets; ++basket) {
+        const Long64_t first = basket_entries[basket];
+        const Long64_t last = basket < n_baskets ? std::min(basket_entries[basket + 1], n_entries) : n_entries;
+        if(first >= last) continue;
+        values.clear();
+        root_ext::detail::BulkReader<T>::Read(branch, first, last - first, &value, values);
+        for(T v : values)
+            ids.push_back(static_cast<IdType>(v));
+    }
+    if(ids.size() != static_cast<size_t>(n_entries))
+        throw analysis::exception("Unable to read all entries of the event id branch '%1%'.") % branch.GetName();
+    tree.ResetBranchAddress(&branch);
+}
+
+std::vector<IdType> ReadIdColumn(TTree& tree, const std::string& branch_name)
+{
+    using ReadMethod = void (*)(TTree&, TBranch&, std::vector<IdType>&);
+    static const std::map<EDataType, ReadMethod> readMethods = {
+        { kInt_t, &ReadIdColumn<Int_t> },
+        { kUInt_t, &ReadIdColumn<UInt_t> },
+        { kLong64_t, &ReadIdColumn<Long64_t> },
+        { kULong64_t, &ReadIdColumn<ULong64_t> },
+    };
+
+    TBranch* branch = tree.GetBranch(branch_name.c_str());
+    if(!branch)
+        throw analysis::exception("Branch '%1%' not found.") % branch_name;
+    TClass* branch_class;
+    EDataType branch_type;
+    branch->GetExpectedType(branch_class, branch_type);
+    if(branch_class || !readMethods.count(branch_type))
+        throw analysis::exception("Unsupported type of the event id branch '%1%'.") % branch_name;
+    std::vector<IdType> ids;
+    (*readMethods.at(branch_type))(tree, *branch, ids);
+    return ids;
+}
+} // anonymous namespace
+
+namespace analysis {
+
+std::string EventIndex::IndexName(const std::string& tree_name) { return tree_name + "_event_index"; }
+std::string EventIndex::SidecarFileName(const std::string& file_name) { return file_name + ".event_index.root"; }
+
+std::string EventIndex::SourceId(const TTree& tree)
+{
+    const TFile* file = tree.GetCurrentFile();
+    std::ostringstream ss;
+    ss << (file ? file->GetUUID().AsString() : "") << ":" << tree.GetEntries() << ":" << tree.GetTotBytes() << ":"
+       << tree.GetZipBytes();
+    return ss.str();
+}
+
+void EventIndex::Build(TTree& tree, const std::vector<std::string>& id_branches, TDirectory& output_dir,
+                       const std::string& index_name)
+{
+    if(id_branches.size() < 3 || id_branches.size() > 4)
+        throw exception("Invalid number of event id branches = %1%.") % id_branches.size();
+
+    if(tree.GetNbranches())
+        tree.SetBranchStatus("*", 0);
+    std::vector<std::vector<IdType>> columns;
+    for(const auto& branch_name : id_branches)
+        columns.push_back(ReadIdColumn(tree, branch_name));
+
+    // Only the permutation of the entries is sorted, so the ids are not stored twice.
+    const auto get_id = [&columns](Long64_t n) {
+        const size_t k = static_cast<size_t>(n);
+        const IdType sample_id = columns.size() > 3 ? columns[3][k] : EventIdentifier::Undef_id;
+        return EventIdentifier(columns[0][k], columns[1][k], columns[2][k], sample_id);
+    };
+    std::vector<Long64_t> index(static_cast<size_t>(tree.GetEntries()));
+    std::iota(index.begin(), index.end(), Long64_t(0));
+    std::sort(index.begin(), index.end(), [&get_id](Long64_t first, Long64_t second) {
+        const EventIdentifier first_id = get_id(first), second_id = get_id(second);
+        if(first_id != second_id) return first_id < second_id;
+        return first < second;
+    });
+
+    const std::string id_title = boost::algorithm::join(id_branches, std::string(1, EventIdentifier::separator));
+    std::unique_ptr<TTree> index_tree(new TTree(index_name.c_str(), id_title.c_str()));
+    index_tree->SetDirectory(&output_dir);
+    index_tree->GetUserInfo()->Add(new TNamed(SourceIdName, SourceId(tree).c_str()));
+    EventIdentifier id;
+    Long64_t entry;
+    index_tree->Branch("run", &id.runId);
+    index_tree->Branch("lumi", &id.lumiBlock);
+    index_tree->Branch("evt", &id.eventId);
+    index_tree->Branch("sampleId", &id.sampleId);
+    index_tree->Branch("entry", &entry);
+    for(Long64_t index_entry : index) {
+        id = get_id(index_entry);
+        entry = index_entry;
+        index_tree->Fill();
+    }
+    root_ext::WriteObject(*index_tree);
+}
+
+std::shared_ptr<EventIndex> EventIndex::TryOpen(const std::shared_ptr<TFile>& file, const std::string& tree_name,
+                                                const std::vector<std::string>& id_branches)
+{
+    const std::string index_name = IndexName(tree_name);
+    const std::string id_title = boost::algorithm::join(id_branches, std::string(1, EventIdentifier::separator));
+    const TTree* tree = root_ext::ReadObject<TTree>(*file, tree_name);
+    const std::string source_id = SourceId(*tree);
+    const auto try_open = [&](const std::shared_ptr<TFile>& index_file) -> std::shared_ptr<EventIndex> {
+        TTree* index_tree = root_ext::TryReadObject<TTree>(*index_file, index_name);
+        if(!index_tree || index_tree->GetTitle() != id_title || index_tree->GetEntries() != tree->GetEntries())
+            return nullptr;
+        const TObject* index_source_id = index_tree->GetUserInfo()->FindObject(SourceIdName);
+        if(!index_source_id || index_source_id->GetTitle() != source_id)
+            return nullptr;
+        return std::make_shared<EventIndex>(index_file, index_tree);
+    };
+
+    auto index = try_open(file);
+    if(index) return index;
+    const std::string sidecar_name = SidecarFileName(file->GetName());
+    if(!boost::filesystem::exists(sidecar_name))
+        return nullptr;
+    return try_open(root_ext::OpenRootFile(sidecar_name));
+}
+
+EventIndex::EventIndex(const std::shared_ptr<TFile>& _file, TTree* _index_tree) :
+    file(_file), index_tree(_index_tree), current_entry(-1)
+{
+    index_tree->SetBranchAddress("run", &current_id.runId);
+    index_tree->SetBranchAddress("lumi", &current_id.lumiBlock);
+    index_tree->SetBranchAddress("evt", &current_id.eventId);
+    index_tree->SetBranchAddress("sampleId", &current_id.sampleId);
+    index_tree->SetBranchAddress("entry", &current_entry);
+}
+
+Long64_t EventIndex::GetEntries() const { return index_tree->GetEntries(); }
+
+std::vector<Long64_t> EventIndex::FindEntries(const EventIdentifier& event_id, size_t max_matches) const
+{
+    Long64_t low = 0, high = GetEntries();
+    while(low < high) {
+        const Long64_t mid = low + (high - low) / 2;
+        if(ReadId(mid) < event_id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    std::vector<Long64_t> entries;
+    for(Long64_t n = low; n < GetEntries() && entries.size() < max_matches && ReadId(n) == event_id; ++n)
+        entries.push_back(current_entry);
+    return entries;
+}
+
+EventIdentifier EventIndex::ReadId(Long64_t n) const
+{
+    if(index_tree->GetEntry(n) <= 0)
+        throw exception("Unable to read entry %1% of the event index.") % n;
+    return current_id;
+}
+
+} // namespace analysis
@@ -0,0 +1,196 @@
+/*! Manifest of the input files that are already merged into the output file.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include "AnalysisTools/Core/include/MergeManifest.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace analysis {
+
+namespace fs = boost::filesystem;
+
+MergeManifest::FileRecord MergeManifest::FileRecord::Create(const std::string& file_name)
+{
+    FileRecord record;
+    record.name = file_name;
+    record.size = fs::file_size(file_name);
+    record.mtime = fs::last_write_time(file_name);
+    record.checksum = ComputeChecksum(file_name);
+    return record;
+}
+
+uint32_t MergeManifest::FileRecord::ComputeChecksum(const std::string& file_name)
+{
+    static constexpr size_t buffer_size = 1024 * 1024;
+    std::ifstream file(file_name, std::ios::binary);
+    if(file.fail())
+        throw exception("Unable to open '%1%' to compute the checksum.") % file_name;
+    boost::crc_32_type crc;
+    std::vector<char> buffer(buffer_size);
+    while(file) {
+        file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        crc.process_bytes(buffer.data(), static_cast<size_t>(file.gcount()));
+    }
+    return crc.checksum();
+}
+
+bool MergeManifest::FileRecord::HasSameSizeAndTime(const FileRecord& other) const
+{
+    return size == other.size && mtime == other.mtime;
+}
+
+std::string MergeManifest::ManifestName(const std::string& output) { return output + ".manifest"; }
+std::string MergeManifest::TemporaryName(const std::string& file_name) { return file_name + ".tmp"; }
+
+MergeManifest::MergeManifest(const std::string& _output) : output(_output) {}
+
+void MergeManifest::Recover()
+{
+    const std::string manifest_name = ManifestName(output);
+    const std::string tmp_output = GetTemporaryOutput();
+    const std::string tmp_manifest = TemporaryName(manifest_name);
+
+    if(fs::exists(tmp_manifest)) {
+        FileRecord new_output;
+        std::map<std::string, FileRecord> records;
+        Read(tmp_manifest, new_output, records);
+        const auto matches = [&](const std::string& file_name) {
+            return fs::exists(file_name) && fs::file_size(file_name) == new_output.size
+                    && FileRecord::ComputeChecksum(file_name) == new_output.checksum;
+        };
+        if(matches(output)) {
+            std::cout << "Completing the interrupted commit of the manifest." << std::endl;
+            fs::rename(tmp_manifest, manifest_name);
+        } else if(matches(tmp_output)) {
+            std::cout << "Completing the interrupted commit of the output." << std::endl;
+            fs::rename(tmp_output, output);
+            fs::rename(tmp_manifest, manifest_name);
+        } else {
+            std::cout << "Removing the incomplete manifest of the interrupted run." << std::endl;
+            fs::remove(tmp_manifest);
+        }
+    }
+    if(fs::exists(tmp_output)) {
+        std::cout << "Removing the incomplete output of the interrupted run." << std::endl;
+        fs::remove(tmp_output);
+    }
+
+    inputs.clear();
+    new_inputs.clear();
+    has_output = fs::exists(manifest_name);
+    if(has_output) {
+        Read(manifest_name, output_record, inputs);
+        if(!fs::exists(output))
+            throw exception("Output '%1%' listed in the manifest does not exist. Remove '%2%' to merge from scratch.")
+                % output % manifest_name;
+        const FileRecord current(FileRecord{ output, fs::file_size(output), fs::last_write_time(output), 0 });
+        if(!current.HasSameSizeAndTime(output_record))
+            throw exception("Output '%1%' was modified after the last merge. Remove '%2%' to merge from scratch.")
+                % output % manifest_name;
+    } else if(fs::exists(output)) {
+        throw exception("Output '%1%' already exists, but it has no manifest. Remove it to merge from scratch.")
+            % output;
+    }
+}
+
+bool MergeManifest::HasOutput() const { return has_output; }
+const std::string& MergeManifest::GetOutput() const { return output; }
+std::string MergeManifest::GetTemporaryOutput() const { return TemporaryName(output); }
+
+std::vector<std::string> MergeManifest::SelectNewInputs(const std::vector<std::string>& input_files)
+{
+    std::vector<std::string> selected;
+    new_inputs.clear();
+    for(const auto& file_name : input_files) {
+        if(fs::exists(output) && fs::equivalent(file_name, output)) continue;
+        auto iter = inputs.find(file_name);
+        if(iter != inputs.end()) {
+            const FileRecord& merged = iter->second;
+            const FileRecord current{ file_name, fs::file_size(file_name), fs::last_write_time(file_name), 0 };
+            if(current.HasSameSizeAndTime(merged)) continue;
+            if(current.size == merged.size && FileRecord::ComputeChecksum(file_name) == merged.checksum) continue;
+            throw exception("Input '%1%' was modified after it was merged. Remove '%2%' and '%3%' to merge from"
+                            " scratch.") % file_name % output % ManifestName(output);
+        }
+        if(new_inputs.count(file_name)) continue;
+        new_inputs[file_name] = FileRecord::Create(file_name);
+        selected.push_back(file_name);
+    }
+    return selected;
+}
+
+void MergeManifest::Commit()
+{
+    for(const auto& input : new_inputs) {
+        const FileRecord current{ input.first, fs::file_size(input.first), fs::last_write_time(input.first), 0 };
+        if(!current.HasSameSizeAndTime(input.second))
+            throw exception("Input '%1%' was modified during the merge.") % input.first;
+    }
+
+    const std::string manifest_name = ManifestName(output);
+    const std::string tmp_output = GetTemporaryOutput();
+    const std::string tmp_manifest = TemporaryName(manifest_name);
+    output_record = FileRecord::Create(tmp_output);
+    output_record.name = output;
+    inputs.insert(new_inputs.begin(), new_inputs.end());
+    new_inputs.clear();
+    Write(tmp_manifest);
+    fs::rename(tmp_output, output);
+    fs::rename(tmp_manifest, manifest_name);
+    has_output = true;
+}
+
+void MergeManifest::Read(const std::string& file_name, FileRecord& _output_record,
+                         std::map<std::string, FileRecord>& records) const
+{
+    std::ifstream f(file_name);
+    if(f.fail())
+        throw exception("Unable to open manifest '%1%'.") % file_name;
+    std::string line;
+    bool has_output_record = false;
+    while(std::getline(f, line)) {
+        if(line.empty() || line.at(0) == '#') continue;
+        std::istringstream ss(line);
+        std::string type;
+        FileRecord record;
+        ss >> type >> record.size >> record.mtime >> record.checksum;
+        ss >> std::ws;
+        std::getline(ss, record.name);
+        if(ss.fail() || record.name.empty())
+            throw exception("Invalid line '%1%' in manifest '%2%'.") % line % file_name;
+        if(type == "output") {
+            _output_record = record;
+            has_output_record = true;
+        } else if(type == "input") {
+            records[record.name] = record;
+        } else {
+            throw exception("Invalid record type '%1%' in manifest '%2%'.") % type % file_name;
+        }
+    }
+    if(!has_output_record)
+        throw exception("Manifest '%1%' has no output record.") % file_name;
+}
+
+void MergeManifest::Write(const std::string& file_name) const
+{
+    std::ofstream f(file_name);
+    if(f.fail())
+        throw exception("Unable to create manifest '%1%'.") % file_name;
+    f << "# type size mtime crc32 name\n";
+    f << "output " << output_record.size << " " << output_record.mtime << " " << output_record.checksum
+      << " " << output_record.name << "\n";
+    for(const auto& input : inputs) {
+        const FileRecord& record = input.second;
+        f << "input " << record.size << " " << record.mtime << " " << record.checksum << " " << record.name << "\n";
+    }
+    f.flush();
+    if(f.fail())
+        throw exception("Unable to write manifest '%1%'.") % file_name;
+}
+
+} // namespace analysis
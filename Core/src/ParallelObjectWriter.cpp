@@ -0,0 +1,214 @@
+/*! Write ROOT objects into a directory with the serialization and compression done by several threads.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include "AnalysisTools/Core/include/ParallelObjectWriter.h"
+
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include <TBufferFile.h>
+#include <TClass.h>
+#include <TKey.h>
+#include <TROOT.h>
+
+#include "AnalysisTools/Core/include/RootCompression.h"
+#include "AnalysisTools/Core/include/RootExt.h"
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace root_ext {
+
+namespace {
+
+constexpr Int_t MinCompressedSize = 256; // smaller objects are never compressed by TKey
+constexpr Int_t InitialBufferSize = 10000;
+constexpr size_t MaxPendingPerThread = 4;
+
+// Key header that is not attached to the file. It is filled by TKey::Build in the same way as for a new key
+// appended to the directory at the given file position, so it has the same length and the same (truncated) title.
+// The position is passed explicitly, because the end of the file is changed by the writer thread.
+class KeyHeader : public TKey {
+public:
+    KeyHeader(TDirectory& dir, const TObject& object, Long64_t file_end) : TKey(file_end, 0, &dir)
+    {
+        SetName(object.GetName());
+        SetTitle(object.GetTitle());
+        Build(&dir, object.ClassName(), file_end);
+        fKeylen = Sizeof();
+    }
+
+    Int_t GetLength() const { return fKeylen; }
+};
+
+// Key that takes the already compressed payload instead of streaming the object.
+class SerializedObjectKey : public TKey {
+public:
+    SerializedObjectKey(TDirectory& dir, const SerializedObject& object) :
+        TKey(object.name.c_str(), object.title.c_str(), object.object->IsA(), static_cast<Int_t>(object.data.size()),
+             &dir)
+    {
+        if(fKeylen != object.key_length)
+            throw analysis::exception("Unexpected key length for object '%1%': %2% != %3%.") % object.name % fKeylen
+                % object.key_length;
+        fObjlen = object.raw_size;
+        fCycle = static_cast<Short_t>(dir.AppendKey(this));
+        // TKey::Create has already allocated the buffer, including the header of the remaining free segment,
+        // if the key is placed into a gap.
+        if(!fBuffer)
+            fBuffer = new char[fNbytes];
+        char* buffer = fBuffer;
+        FillBuffer(buffer);
+        std::copy(object.data.begin(), object.data.end(), fBuffer + fKeylen);
+    }
+};
+
+void AppendSerializedObject(TDirectory& dir, TFile& file, const SerializedObject& object)
+{
+    TKey* key = new SerializedObjectKey(dir, object);
+    file.SumBuffer(object.raw_size);
+    if(key->WriteFile(0) <= 0)
+        throw analysis::exception("Unable to write object '%1%' into '%2%'.") % object.name % dir.GetPath();
+}
+
+} // anonymous namespace
+
+SerializedObject::SerializedObject(const TObject& _object, TFile& file, Long64_t file_end) :
+    object(&_object), name(_object.GetName()), class_name(_object.ClassName())
+{
+    const KeyHeader header(file, _object, file_end);
+    title = header.GetTitle();
+    key_length = header.GetLength();
+
+    // The space for the key header is reserved, so the offsets stored in the streamed object are the same
+    // as if it was streamed by TKey.
+    TBufferFile buffer(TBuffer::kWrite, key_length + InitialBufferSize);
+    buffer.SetParent(&file);
+    buffer.SetBufferOffset(key_length);
+    buffer.MapObject(object);
+    const_cast<TObject*>(object)->Streamer(buffer);
+    raw_size = buffer.Length() - key_length;
+    const char* begin = buffer.Buffer() + key_length;
+    data.assign(begin, begin + raw_size);
+
+    const int level = file.GetCompressionLevel();
+    if(level > 0 && raw_size > MinCompressedSize) {
+        const auto algorithm = static_cast<ROOT::ECompressionAlgorithm>(file.GetCompressionAlgorithm());
+        data = CompressBuffer(data, CompressionSetting(algorithm, level));
+    }
+}
+
+void WriteSerializedObject(TDirectory& dir, const SerializedObject& object)
+{
+    TFile* file = dir.GetFile();
+    if(!file)
+        throw analysis::exception("Directory '%1%' is not attached to a file.") % dir.GetName();
+    // The old key is deleted first, as WriteObject does, so the new key gets the same cycle and can reuse its space.
+    if(TKey* old_key = dir.GetKey(object.name.c_str())) {
+        old_key->Delete();
+        delete old_key;
+    }
+    // The key length depends on the position in the file, which can cross TFile::kStartBigFile after the object
+    // was serialized. In this case the offsets stored in the object are not valid, so it is serialized again.
+    if(KeyHeader(dir, *object.object, file->GetEND()).GetLength() != object.key_length)
+        AppendSerializedObject(dir, *file, SerializedObject(*object.object, *file, file->GetEND()));
+    else
+        AppendSerializedObject(dir, *file, object);
+}
+
+void WriteObjectsParallel(TDirectory& dir, const std::vector<const TObject*>& objects, size_t n_threads)
+{
+    if(n_threads <= 1 || objects.size() <= 1) {
+        for(const TObject* object : objects)
+            WriteObject(*object, &dir);
+        return;
+    }
+    TFile* file = dir.GetFile();
+    if(!file)
+        throw analysis::exception("Directory '%1%' is not attached to a file.") % dir.GetName();
+    ROOT::EnableThreadSafety();
+
+    std::vector<std::unique_ptr<SerializedObject>> results(objects.size());
+    std::vector<bool> prepared(objects.size(), false);
+
+    // The first object of each class is serialized before the workers are started. This registers the streamer
+    // infos of the class in the file, so the workers only read the class index of the file.
+    std::set<const TClass*> classes;
+    for(size_t n = 0; n < objects.size(); ++n) {
+        if(!classes.insert(objects.at(n)->IsA()).second) continue;
+        results.at(n) = std::make_unique<SerializedObject>(*objects.at(n), *file, file->GetEND());
+        prepared.at(n) = true;
+    }
+
+    const size_t max_pending = MaxPendingPerThread * n_threads;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t next_object = 0, n_written = 0;
+    Long64_t file_end = file->GetEND(); // updated by the writer, so the workers never read it from the file
+    std::exception_ptr error;
+
+    const auto set_error = [&](std::exception_ptr e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!error)
+            error = e;
+        cv.notify_all();
+    };
+
+    const auto worker = [&]() {
+        while(true) {
+            size_t index;
+            Long64_t object_file_end;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() {
+                    return error || next_object >= objects.size() || next_object < n_written + max_pending;
+                });
+                if(error || next_object >= objects.size()) return;
+                index = next_object++;
+                object_file_end = file_end;
+            }
+            if(prepared.at(index)) continue;
+            try {
+                auto result = std::make_unique<SerializedObject>(*objects.at(index), *file, object_file_end);
+                std::lock_guard<std::mutex> lock(mutex);
+                results.at(index) = std::move(result);
+                cv.notify_all();
+            } catch(...) {
+                set_error(std::current_exception());
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for(size_t n = 0; n < std::min(n_threads, objects.size()); ++n)
+        workers.emplace_back(worker);
+
+    try {
+        for(size_t n = 0; n < objects.size(); ++n) {
+            std::unique_ptr<SerializedObject> result;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return error || results.at(n); });
+                if(error) break;
+                result = std::move(results.at(n));
+            }
+            WriteSerializedObject(dir, *result);
+            std::lock_guard<std::mutex> lock(mutex);
+            ++n_written;
+            file_end = file->GetEND();
+            cv.notify_all();
+        }
+    } catch(...) {
+        set_error(std::current_exception());
+    }
+
+    for(auto& thread : workers)
+        thread.join();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+} // namespace root_ext
@@ -0,0 +1,86 @@
+/*! Compression of memory buffers in the same block format as ROOT uses for the baskets and keys.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include "AnalysisTools/Core/include/RootCompression.h"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <RZip.h>
+#include "AnalysisTools/Core/include/exception.h"
+
+namespace {
+// Limits of the ROOT compression block format, see TBasket::WriteBuffer.
+constexpr int MaxZipChunkSize = 0xffffff;
+constexpr int ZipHeaderSize = 9;
+}
+
+namespace root_ext {
+
+CompressionSetting::CompressionSetting(ROOT::ECompressionAlgorithm _algorithm, int _level) :
+    algorithm(_algorithm), level(_level) {}
+
+int CompressionSetting::Settings() const { return ROOT::CompressionSettings(algorithm, level); }
+
+std::string CompressionSetting::ToString() const { return ToString(Settings()); }
+
+std::string CompressionSetting::ToString(int settings)
+{
+    static const std::map<int, std::string> names = {
+        { ROOT::kZLIB, "ZLIB" }, { ROOT::kLZMA, "LZMA" }, { ROOT::kOldCompressionAlgo, "OLD" },
+        { ROOT::kLZ4, "LZ4" }, { ROOT::kZSTD, "ZSTD" },
+    };
+    const int algorithm = settings / 100, level = settings % 100;
+    std::ostringstream ss;
+    if(level == 0)
+        ss << "none";
+    else if(names.count(algorithm))
+        ss << names.at(algorithm) << "-" << level;
+    else
+        ss << settings;
+    return ss.str();
+}
+
+// As in TBasket::WriteBuffer, the data is split into blocks of at most MaxZipChunkSize bytes.
+CompressionBuffer CompressBuffer(const CompressionBuffer& data, const CompressionSetting& setting)
+{
+    CompressionBuffer output(data.size() + ZipHeaderSize);
+    size_t out_pos = 0;
+    for(size_t pos = 0; pos < data.size(); pos += MaxZipChunkSize) {
+        int src_size = static_cast<int>(std::min<size_t>(MaxZipChunkSize, data.size() - pos));
+        int tgt_size = static_cast<int>(output.size() - out_pos);
+        int out_size = 0;
+        R__zipMultipleAlgorithm(setting.level, &src_size, const_cast<char*>(data.data() + pos), &tgt_size,
+                                output.data() + out_pos, &out_size, setting.algorithm);
+        out_pos += static_cast<size_t>(std::max(out_size, 0));
+        if(out_size <= 0 || out_pos >= data.size())
+            return data;
+    }
+    output.resize(out_pos);
+    return output;
+}
+
+CompressionBuffer DecompressBuffer(const CompressionBuffer& zip_data, size_t raw_size)
+{
+    if(zip_data.size() == raw_size)
+        return zip_data;
+
+    CompressionBuffer output(raw_size);
+    size_t in_pos = 0, out_pos = 0;
+    while(in_pos < zip_data.size()) {
+        auto src = reinterpret_cast<unsigned char*>(const_cast<char*>(zip_data.data() + in_pos));
+        int src_size = 0, tgt_size = 0, out_size = 0;
+        if(R__unzip_header(&src_size, src, &tgt_size) != 0 || out_pos + static_cast<size_t>(tgt_size) > raw_size)
+            throw analysis::exception("Invalid compressed block header.");
+        R__unzip(&src_size, src, &tgt_size, reinterpret_cast<unsigned char*>(output.data() + out_pos), &out_size);
+        if(out_size != tgt_size)
+            throw analysis::exception("Decompression failed.");
+        in_pos += static_cast<size_t>(src_size);
+        out_pos += static_cast<size_t>(out_size);
+    }
+    if(out_pos != raw_size)
+        throw analysis::exception("Decompressed size %1% doesn't match the expected size %2%.") % out_pos % raw_size;
+    return output;
+}
+
+} // namespace root_ext
@@ -11,6 +11,8 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 #include <TLorentzVector.h>
 #include <TMatrixD.h>
 #include <TFile.h>
+#include <TKey.h>
+#include <TStreamerInfo.h>
 #include <Compression.h>
 
 #include "AnalysisTools/Core/include/exception.h"
@@ -42,6 +44,52 @@ void WriteObject(const TObject& object, TDirectory* dir, const std::string& name
     dir->WriteTObject(&object, name_to_write.c_str(), "Overwrite");
 }
 
+RawKeyCopier::RawKeyCopier(TFile& source_file)
+    : source_infos(source_file.GetStreamerInfoList())
+{
+}
+
+void RawKeyCopier::Copy(TKey& key, TDirectory& destination)
+{
+    TFile* destination_file = destination.GetFile();
+    if(!destination_file)
+        throw analysis::exception("Directory '%1%' does not belong to a file.") % destination.GetName();
+    if(CopyStreamerInfo(*destination_file, key.GetClassName())) {
+        TKey* new_key = new TKey(&destination, key, 0);
+        if(new_key->WriteFile() <= 0)
+            throw analysis::exception("Unable to copy object '%1%' to '%2%'.") % key.GetName() % destination.GetName();
+    } else {
+        std::unique_ptr<TObject> object(key.ReadObj());
+        if(!object || destination.WriteTObject(object.get(), key.GetName()) <= 0)
+            throw analysis::exception("Unable to copy object '%1%' to '%2%'.") % key.GetName() % destination.GetName();
+    }
+}
+
+// Same as TTreeCloner::CopyStreamerInfos, but only for the given class. ForceWriteInfo marks also the streamer
+// infos of the base classes and of the members.
+bool RawKeyCopier::CopyStreamerInfo(TFile& destination_file, const std::string& class_name)
+{
+    const auto copied_key = std::make_pair(&destination_file, class_name);
+    if(copied_infos.count(copied_key))
+        return true;
+    if(!source_infos)
+        return false;
+    bool found = false;
+    TIter next(source_infos.get());
+    for(TObject* object; (object = next());) {
+        auto info = dynamic_cast<TStreamerInfo*>(object);
+        if(!info || class_name != info->GetName()) continue;
+        TVirtualStreamerInfo* current_info = nullptr;
+        TClass* cl = TClass::GetClass(info->GetName());
+        if(cl && (!cl->IsLoaded() || cl->GetNew()))
+            current_info = cl->GetStreamerInfo(info->GetClassVersion());
+        (current_info ? current_info : info)->ForceWriteInfo(&destination_file);
+        found = true;
+    }
+    if(found)
+        copied_infos.insert(copied_key);
+    return found;
+}
 
 TDirectory* GetDirectory(TDirectory& root_dir, const std::string& name, bool create_if_needed)
 {
@@ -3,6 +3,7 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 
 #include "AnalysisTools/Core/include/RootFilesMerger.h"
 
+#include <future>
 #include <iostream>
 #include <unordered_map>
 #include <boost/filesystem.hpp>
@@ -13,11 +14,21 @@ This file is part of https://github.com/hh-italian-group/AnalysisTools. */
 #include <TTree.h>
 #include <TChain.h>
 #include <TH1.h>
+#include <TLeaf.h>
 #include <memory>
 #include "AnalysisTools/Core/include/RootExt.h"
 #include "AnalysisTools/Core/include/TextIO.h"
 
 namespace {
+void SetCompressionSettings(TObjArray& branches, int compression_settings)
+{
+    for(auto branch_obj : branches) {
+        auto branch = dynamic_cast<TBranch*>(branch_obj);
+        branch->SetCompressionSettings(compression_settings);
+        SetCompressionSettings(*branch->GetListOfBranches(), compression_settings);
+    }
+}
+
 void CollectInputFiles(const boost::filesystem::path& dir, std::vector<std::string>& files,
                        const boost::regex& pattern, const std::set<std::string>& exclude,
                        const std::set<std::string>& exclude_dirs)
@@ -35,109 +46,373 @@ void CollectInputFiles(const boost::filesystem::path& dir, std::vector<std::stri
 
 namespace analysis {
 
-RootFilesMerger::HistDescriptor::HistDescriptor() { hists.reserve(MergeThreshold + 1); }
+RootFilesMerger::HistDescriptor::HistDescriptor() {}
 
-void RootFilesMerger::HistDescriptor::AddHistogram(HistPtr&& new_hist)
+void RootFilesMerger::HistDescriptor::AddHistogram(size_t file_index, HistPtr&& new_hist)
 {
-    hists.push_back(std::move(new_hist));
-    if(hists.size() > MergeThreshold)
-        Merge();
+    NodeId id(0, file_index);
+    HistPtr hist = std::move(new_hist);
+    while(true) {
+        HistPtr sibling;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto iter = nodes.find(NodeId(id.first, id.second ^ 1));
+            if(iter == nodes.end()) {
+                nodes[id] = std::move(hist);
+                return;
+            }
+            sibling = std::move(iter->second);
+            nodes.erase(iter);
+        }
+        if(id.second % 2)
+            std::swap(hist, sibling);
+        MergeHistograms(*hist, *sibling);
+        id = NodeId(id.first + 1, id.second / 2);
+    }
 }
 
 const RootFilesMerger::HistPtr& RootFilesMerger::HistDescriptor::GetMergedHisto() const
 {
-    if(hists.size() != 1)
+    if(nodes.size() != 1)
         throw analysis::exception("Merged histogram is not ready");
-    return hists[0];
+    return nodes.begin()->second;
 }
 
+// Complete the tree for the nodes without siblings, i.e. for the files that don't contain the histogram.
+// The node with the lowest (level, index) is always either the left sibling or it has no sibling at all.
 void RootFilesMerger::HistDescriptor::Merge()
 {
-    if(hists.size() <= 1) return;
-    {
-        TList list;
-        for(size_t n = 1; n < hists.size(); ++n)
-            list.Add(hists[n].get());
-        hists[0]->Merge(&list);
+    std::lock_guard<std::mutex> lock(mutex);
+    while(nodes.size() > 1) {
+        auto first = nodes.begin();
+        const NodeId id = first->first;
+        HistPtr hist = std::move(first->second);
+        nodes.erase(first);
+        auto sibling = nodes.find(NodeId(id.first, id.second ^ 1));
+        if(sibling != nodes.end()) {
+            MergeHistograms(*hist, *sibling->second);
+            nodes.erase(sibling);
+        }
+        nodes[NodeId(id.first + 1, id.second / 2)] = std::move(hist);
     }
-    hists.resize(1);
+}
+
+void RootFilesMerger::HistDescriptor::MergeHistograms(TH1& first, TH1& second)
+{
+    TList list;
+    list.Add(&second);
+    first.Merge(&list);
 }
 
 std::atomic<size_t>& RootFilesMerger::TreeDescriptor::NumberOfFiles()
 {
-    static std::atomic<size_t> n_files = 1;
+    static std::atomic<size_t> n_files(1);
     return n_files;
 }
 
 RootFilesMerger::TreeDescriptor::TreeDescriptor() { file_names.reserve(NumberOfFiles()); }
-void RootFilesMerger::TreeDescriptor::AddFile(const std::string& file_name) { file_names.push_back(file_name); }
+
+void RootFilesMerger::TreeDescriptor::AddFile(size_t file_index, const std::string& file_name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    file_names.emplace_back(file_index, file_name);
+}
+
+std::vector<std::string> RootFilesMerger::TreeDescriptor::GetFileNames()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::sort(file_names.begin(), file_names.end());
+    std::vector<std::string> names;
+    for(const auto& file_name : file_names)
+        names.push_back(file_name.second);
+    return names;
+}
 
 RootFilesMerger::TreeDescriptor::ChainPtr RootFilesMerger::TreeDescriptor::CreateChain(
-    const std::string& full_name) const
+    const std::string& full_name)
 {
     auto chain = std::make_unique<TChain>(full_name.c_str());
-    for(const auto& file_name : file_names)
+    for(const auto& file_name : GetFileNames())
         chain->AddFile(file_name.c_str());
     return chain;
 }
 
+RootFilesMerger::HistDescriptor& RootFilesMerger::ObjectCollection::GetHist(const Key& key)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return hists[key];
+}
+
+RootFilesMerger::TreeDescriptor& RootFilesMerger::ObjectCollection::GetTree(const Key& key)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return trees[key];
+}
+
+void RootFilesMerger::ObjectCollection::UpdateHistSize(const Key& key, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t& max_size = hist_sizes[key];
+    max_size = std::max(max_size, size);
+}
+
 RootFilesMerger::RootFilesMerger(const std::string& output, const std::vector<std::string>& input_dirs,
                 const std::string& file_name_pattern, const std::string& exclude_list,
-                const std::string& exclude_dir_list, unsigned n_threads, ROOT::ECompressionAlgorithm compression,
+                const std::string& exclude_dir_list, unsigned _n_threads, ROOT::ECompressionAlgorithm compression,
                 int compression_level) :
-    input_files(FindInputFiles(input_dirs, file_name_pattern, exclude_list, exclude_dir_list)),
-    output_file(root_ext::CreateRootFile(output, compression, compression_level))
+    RootFilesMerger(output, FindInputFiles(input_dirs, file_name_pattern, exclude_list, exclude_dir_list),
+                    _n_threads, compression, compression_level)
+{
+}
+
+RootFilesMerger::RootFilesMerger(const std::string& output, const std::vector<std::string>& _input_files,
+                                 unsigned _n_threads, ROOT::ECompressionAlgorithm compression,
+                                 int compression_level) :
+    input_files(_input_files), output_file(root_ext::CreateRootFile(output, compression, compression_level)),
+    n_threads(_n_threads)
 {
     TreeDescriptor::NumberOfFiles() = input_files.size();
     if(n_threads > 1)
         ROOT::EnableImplicitMT(n_threads);
 }
 
+template<typename Function>
+void RootFilesMerger::RunParallel(size_t n_tasks, Function function) const
+{
+    const size_t n_workers = std::max<size_t>(1, std::min<size_t>(n_threads, n_tasks));
+    std::atomic<size_t> next_task(0);
+    const auto worker = [&]() {
+        for(size_t n = next_task++; n < n_tasks; n = next_task++)
+            function(n);
+    };
+    if(n_workers == 1) {
+        worker();
+        return;
+    }
+    std::vector<std::future<void>> results;
+    for(size_t n = 0; n < n_workers; ++n)
+        results.push_back(std::async(std::launch::async, worker));
+    for(auto& result : results)
+        result.get();
+}
+
 void RootFilesMerger::Process(bool process_histograms, bool process_trees)
 {
-    for(const auto& file_name : input_files) {
-        std::cout << "file: " << file_name << std::endl;
+    if(memory_budget) {
+        ProcessWithMemoryBudget(process_histograms, process_trees);
+        return;
+    }
+
+    std::mutex process_file_mutex;
+    const HistogramAction hist_action = process_histograms ? HistogramAction::Read : HistogramAction::Skip;
+    RunParallel(input_files.size(), [&](size_t file_index) {
+        const std::string& file_name = input_files.at(file_index);
         auto file = root_ext::OpenRootFile(file_name);
-        ProcessDirectory(file_name, "", file.get(), objects, process_histograms, process_trees);
+        ProcessDirectory(file_index, file_name, "", file.get(), objects, hist_action, process_trees);
+        std::lock_guard<std::mutex> lock(process_file_mutex);
+        std::cout << "file: " << file_name << std::endl;
         ProcessFile(file_name, file);
-    }
+    });
 
     if(process_histograms) {
         std::cout << "Writing histograms..." << std::endl;
-        {
-            std::map<Key, const HistDescriptor*> ordered_histograms;
-            for(auto& hist_entry : objects.hists) {
-                hist_entry.second.Merge();
-                ordered_histograms[hist_entry.first] = &hist_entry.second;
-            }
+        WriteHistograms();
+    }
 
-            for(auto& hist_entry : ordered_histograms) {
-                auto dir = root_ext::GetDirectory(*output_file, hist_entry.first.dir_name);
-                root_ext::WriteObject(*hist_entry.second->GetMergedHisto(), dir);
-            }
-            objects.hists.clear();
+    if(process_trees)
+        MergeTrees();
+}
+
+// The first pass collects the trees and the sizes of the histograms, the following passes read the histograms
+// batch by batch.
+void RootFilesMerger::ProcessWithMemoryBudget(bool process_histograms, bool process_trees)
+{
+    std::mutex process_file_mutex;
+    const HistogramAction hist_action = process_histograms ? HistogramAction::Scan : HistogramAction::Skip;
+    RunParallel(input_files.size(), [&](size_t file_index) {
+        const std::string& file_name = input_files.at(file_index);
+        auto file = root_ext::OpenRootFile(file_name);
+        ProcessDirectory(file_index, file_name, "", file.get(), objects, hist_action, process_trees);
+        std::lock_guard<std::mutex> lock(process_file_mutex);
+        std::cout << "file: " << file_name << std::endl;
+        ProcessFile(file_name, file);
+    });
+
+    if(process_histograms) {
+        const auto batches = SplitIntoBatches();
+        for(size_t batch_index = 0; batch_index < batches.size(); ++batch_index) {
+            const auto& batch = batches.at(batch_index);
+            std::cout << "Merging histograms: batch " << batch_index + 1 << "/" << batches.size() << ", "
+                      << batch.size() << " directories..." << std::endl;
+            RunParallel(input_files.size(), [&](size_t file_index) {
+                auto file = root_ext::OpenRootFile(input_files.at(file_index));
+                for(const auto& dir_name : batch) {
+                    const std::string path = dir_name.substr(0, dir_name.size() - 1);
+                    TDirectory* dir = path.empty() ? file.get() : file->GetDirectory(path.c_str());
+                    if(dir)
+                        ProcessDirectory(file_index, input_files.at(file_index), dir_name, dir, objects,
+                                         HistogramAction::Read, false, false);
+                }
+            });
+            WriteHistograms();
+        }
+        objects.hist_sizes.clear();
+    }
+
+    if(process_trees)
+        MergeTrees();
+}
+
+// Peak memory to merge a histogram is estimated as its size times the maximal number of partially merged
+// copies that can be kept at the same time: one per thread plus one per level of the merge tree.
+std::vector<std::set<std::string>> RootFilesMerger::SplitIntoBatches() const
+{
+    size_t n_levels = 1;
+    while((size_t(1) << n_levels) < input_files.size())
+        ++n_levels;
+    const size_t n_copies = std::max<size_t>(n_threads, 1) + n_levels + 1;
+
+    std::map<std::string, size_t> dir_sizes;
+    for(const auto& hist_size : objects.hist_sizes)
+        dir_sizes[hist_size.first.dir_name] += hist_size.second * n_copies;
+
+    std::vector<std::set<std::string>> batches;
+    size_t batch_size = 0;
+    for(const auto& dir : dir_sizes) {
+        if(batches.empty() || batch_size + dir.second > memory_budget) {
+            batches.emplace_back();
+            batch_size = 0;
         }
+        batches.back().insert(dir.first);
+        batch_size += dir.second;
+    }
+    return batches;
+}
+
+void RootFilesMerger::WriteHistograms()
+{
+    std::vector<HistDescriptor*> descriptors;
+    std::map<Key, const HistDescriptor*> ordered_histograms;
+    for(auto& hist_entry : objects.hists) {
+        descriptors.push_back(&hist_entry.second);
+        ordered_histograms[hist_entry.first] = &hist_entry.second;
     }
+    RunParallel(descriptors.size(), [&](size_t n) { descriptors.at(n)->Merge(); });
 
-    if(process_trees) {
-        std::map<Key, const TreeDescriptor*> ordered_trees;
-        for(auto& tree_entry : objects.trees)
-            ordered_trees[tree_entry.first] = &tree_entry.second;
-        for(auto& tree : ordered_trees) {
-            std::cout << "tree: " << tree.first.full_name << std::endl;
-            auto dir = root_ext::GetDirectory(*output_file, tree.first.dir_name);
-            Long64_t n_entries = -1;
+    for(auto& hist_entry : ordered_histograms) {
+        auto dir = root_ext::GetDirectory(*output_file, hist_entry.first.dir_name);
+        root_ext::WriteObject(*hist_entry.second->GetMergedHisto(), dir);
+    }
+    objects.hists.clear();
+}
+
+void RootFilesMerger::MergeTrees()
+{
+    std::map<Key, TreeDescriptor*> ordered_trees;
+    for(auto& tree_entry : objects.trees)
+        ordered_trees[tree_entry.first] = &tree_entry.second;
+    for(auto& tree : ordered_trees) {
+        std::cout << "tree: " << tree.first.full_name << std::endl;
+        if(fast_tree_merge) {
+            MergeTree(tree.first, *tree.second);
+            continue;
+        }
+        auto dir = root_ext::GetDirectory(*output_file, tree.first.dir_name);
+        Long64_t n_entries = -1;
+        dir->cd();
+        {
+            auto chain = tree.second->CreateChain(tree.first.full_name);
+            n_entries = chain->GetEntries();
+            chain->Merge(output_file.get(), 0, "C keep");
+        }
+        std::unique_ptr<TTree> merged_tree(root_ext::ReadObject<TTree>(*output_file, tree.first.full_name));
+        if(merged_tree->GetEntries() != n_entries)
+            throw analysis::exception("Not all files were merged for '%1%' tree.") % tree.first.full_name;
+    }
+}
+
+void RootFilesMerger::MergeTree(const Key& key, TreeDescriptor& descriptor)
+{
+    const int compression_settings = output_file->GetCompressionSettings();
+    auto dir = root_ext::GetDirectory(*output_file, key.dir_name);
+    TTree* output_tree = nullptr;
+    Long64_t n_entries = 0;
+    size_t n_fast = 0, n_slow = 0;
+    for(const auto& file_name : descriptor.GetFileNames()) {
+        auto file = root_ext::OpenRootFile(file_name);
+        std::unique_ptr<TTree> input_tree(root_ext::ReadObject<TTree>(*file, key.full_name));
+        n_entries += input_tree->GetEntries();
+        if(!output_tree) {
             dir->cd();
-            {
-                auto chain = tree.second->CreateChain(tree.first.full_name);
-                n_entries = chain->GetEntries();
-                chain->Merge(output_file.get(), 0, "C keep");
-            }
-            std::unique_ptr<TTree> merged_tree(root_ext::ReadObject<TTree>(*output_file, tree.first.full_name));
-            if(merged_tree->GetEntries() != n_entries)
-                throw analysis::exception("Not all files were merged for '%1%' tree.") % tree.first.full_name;
+            output_tree = input_tree->CloneTree(0);
+            output_tree->SetDirectory(dir);
+            SetCompressionSettings(*output_tree->GetListOfBranches(), compression_settings);
+        }
+
+        std::string reason;
+        const bool fast = IsFastMergePossible(*input_tree->GetListOfBranches(), *output_tree->GetListOfBranches(),
+                                              compression_settings, reason);
+        const Long64_t n_bytes = fast ? output_tree->CopyEntries(input_tree.get(), -1, "fast")
+                                      : output_tree->CopyEntries(input_tree.get(), -1, "", true);
+        if(n_bytes < 0)
+            throw analysis::exception("Unable to copy '%1%' tree from '%2%'.") % key.full_name % file_name;
+        if(fast) {
+            ++n_fast;
+            std::cout << "\tfast: " << file_name << std::endl;
+        } else {
+            ++n_slow;
+            std::cout << "\tslow: " << file_name << " (" << reason << ")" << std::endl;
         }
     }
+    if(!output_tree) return;
+
+    if(output_tree->GetEntries() != n_entries)
+        throw analysis::exception("Not all files were merged for '%1%' tree.") % key.full_name;
+    root_ext::WriteObject(*output_tree, dir);
+    dir->Delete(output_tree->GetName());
+    std::cout << "\t" << n_fast << " files copied without recompression, " << n_slow << " files recompressed."
+              << std::endl;
+}
+
+bool RootFilesMerger::IsFastMergePossible(const TObjArray& input_branches, const TObjArray& output_branches,
+                                          int compression_settings, std::string& reason)
+{
+    if(input_branches.GetEntries() != output_branches.GetEntries()) {
+        reason = "different number of branches";
+        return false;
+    }
+    for(Int_t n = 0; n < input_branches.GetEntries(); ++n) {
+        auto input = dynamic_cast<TBranch*>(input_branches.At(n));
+        auto output = dynamic_cast<TBranch*>(output_branches.At(n));
+        const std::string name = input->GetName();
+        if(name != output->GetName()) {
+            reason = "branch '" + name + "' is not expected at this position";
+            return false;
+        }
+        if(std::string(input->GetClassName()) != output->GetClassName()) {
+            reason = "type of branch '" + name + "' is different";
+            return false;
+        }
+        const auto input_leaves = input->GetListOfLeaves();
+        const auto output_leaves = output->GetListOfLeaves();
+        bool same_leaves = input_leaves->GetEntries() == output_leaves->GetEntries();
+        for(Int_t k = 0; same_leaves && k < input_leaves->GetEntries(); ++k) {
+            same_leaves = std::string(dynamic_cast<TLeaf*>(input_leaves->At(k))->GetTypeName())
+                    == dynamic_cast<TLeaf*>(output_leaves->At(k))->GetTypeName();
+        }
+        if(!same_leaves) {
+            reason = "leaves of branch '" + name + "' are different";
+            return false;
+        }
+        if(input->GetCompressionSettings() != compression_settings) {
+            reason = "compression of branch '" + name + "' is different";
+            return false;
+        }
+        if(!IsFastMergePossible(*input->GetListOfBranches(), *output->GetListOfBranches(), compression_settings,
+                                reason))
+            return false;
+    }
+    return true;
 }
 
 std::vector<std::string> RootFilesMerger::FindInputFiles(const std::vector<std::string>& dirs,
@@ -160,32 +435,47 @@ std::vector<std::string> RootFilesMerger::FindInputFiles(const std::vector<std::
     return files;
 }
 
-void RootFilesMerger::ProcessDirectory(const std::string& file_name, const std::string& dir_name, TDirectory* dir,
-                             ObjectCollection& objects, bool process_histograms, bool process_trees)
+root_ext::ClassInheritance RootFilesMerger::GetClassInheritance(const std::string& class_name)
+{
+    static std::unordered_map<std::string, root_ext::ClassInheritance> cache;
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = cache.find(class_name);
+    if(iter == cache.end())
+        iter = cache.emplace(class_name, root_ext::FindClassInheritance(class_name)).first;
+    return iter->second;
+}
+
+void RootFilesMerger::ProcessDirectory(size_t file_index, const std::string& file_name, const std::string& dir_name,
+                                       TDirectory* dir, ObjectCollection& objects, HistogramAction hist_action,
+                                       bool process_trees, bool recursive)
 {
     using ClassInheritance = root_ext::ClassInheritance;
     TIter nextkey(dir->GetListOfKeys());
     for(TKey* t_key; (t_key = dynamic_cast<TKey*>(nextkey()));) {
-        const ClassInheritance inheritance = root_ext::FindClassInheritance(t_key->GetClassName());
+        const ClassInheritance inheritance = GetClassInheritance(t_key->GetClassName());
         const Key key(dir_name, t_key->GetName());
 
         switch (inheritance) {
             case ClassInheritance::TH1: {
-                if(process_histograms) {
+                if(hist_action == HistogramAction::Read) {
                     auto hist = HistPtr(root_ext::ReadObject<TH1>(*dir, key.name));
                     hist->SetDirectory(nullptr);
-                    objects.hists[key].AddHistogram(std::move(hist));
+                    objects.GetHist(key).AddHistogram(file_index, std::move(hist));
+                } else if(hist_action == HistogramAction::Scan) {
+                    objects.UpdateHistSize(key, static_cast<size_t>(t_key->GetObjlen()));
                 }
                 break;
             }
             case ClassInheritance::TTree: {
                 if(process_trees) {
-                    objects.trees[key].AddFile(file_name);
+                    objects.GetTree(key).AddFile(file_index, file_name);
                 }
                 break;
             } case ClassInheritance::TDirectory: {
+                if(!recursive) break;
                 auto subdir = root_ext::ReadObject<TDirectory>(*dir, key.name);
-                ProcessDirectory(file_name, key.full_name + "/", subdir, objects, process_histograms,
+                ProcessDirectory(file_index, file_name, key.full_name + "/", subdir, objects, hist_action,
                                  process_trees);
                 break;
             }
@@ -0,0 +1,50 @@
+/*! Thread-local tables keyed by the unique ids of objects.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include "AnalysisTools/Core/include/ThreadUidTable.h"
+
+#include <mutex>
+#include <unordered_set>
+
+namespace root_ext {
+namespace detail {
+
+namespace {
+struct UidRegistry {
+    std::mutex mutex;
+    size_t next_uid{0};
+    std::unordered_set<size_t> uids_in_use;
+};
+
+UidRegistry& GetUidRegistry()
+{
+    static UidRegistry registry;
+    return registry;
+}
+} // anonymous namespace
+
+size_t AcquireUid()
+{
+    auto& registry = GetUidRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    const size_t uid = registry.next_uid++;
+    registry.uids_in_use.insert(uid);
+    return uid;
+}
+
+void ReleaseUid(size_t uid)
+{
+    auto& registry = GetUidRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.uids_in_use.erase(uid);
+}
+
+bool IsUidInUse(size_t uid)
+{
+    auto& registry = GetUidRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    return registry.uids_in_use.count(uid);
+}
+
+} // namespace detail
+} // namespace root_ext
@@ -0,0 +1,126 @@
+/*! Test the sharded filling of AnalyzerData.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include <atomic>
+#include <thread>
+#include "AnalysisTools/Core/include/AnalyzerData.h"
+
+#define BOOST_TEST_MODULE AnalyzerDataSharding_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+namespace {
+struct TestData : public root_ext::AnalyzerData {
+    TestData()
+    {
+        emplaced.Emplace("custom", 7, 0.5, 2.5);
+    }
+
+    TH1D_ENTRY(hist, 20, 0, 10)
+    ANA_DATA_ENTRY(TH1D, emplaced)
+};
+
+constexpr size_t NumberOfThreads = 4;
+constexpr int NumberOfValues = 20000;
+
+double Value(int n) { return (n * 37 % 1000) / 100.; }
+double Weight(int n) { return 0.5 + n % 3 * 0.25; }
+
+// Each thread fills a fixed part of the values into its own shard.
+void FillSharded(TestData& data)
+{
+    data.EnableSharding();
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < NumberOfThreads; ++t) {
+        threads.emplace_back([&data, t]() {
+            data.SetThreadShardIndex(t);
+            for(int n = static_cast<int>(t); n < NumberOfValues; n += static_cast<int>(NumberOfThreads)) {
+                data.hist(n % 3).Fill(Value(n), Weight(n));
+                data.emplaced("custom").Fill(Value(n) / 4);
+            }
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+    data.MergeShards();
+}
+
+void FillSequential(TestData& data)
+{
+    for(int n = 0; n < NumberOfValues; ++n) {
+        data.hist(n % 3).Fill(Value(n), Weight(n));
+        data.emplaced("custom").Fill(Value(n) / 4);
+    }
+}
+
+void CheckSameHistograms(const TH1& hist, const TH1& ref_hist, double tolerance)
+{
+    BOOST_TEST_REQUIRE(hist.GetNcells() == ref_hist.GetNcells());
+    for(Int_t bin = 0; bin < ref_hist.GetNcells(); ++bin) {
+        BOOST_TEST(hist.GetBinContent(bin) == ref_hist.GetBinContent(bin), boost::test_tools::tolerance(tolerance));
+        BOOST_TEST(hist.GetBinError(bin) == ref_hist.GetBinError(bin), boost::test_tools::tolerance(tolerance));
+    }
+    BOOST_TEST(hist.GetEntries() == ref_hist.GetEntries());
+}
+
+void CheckSameData(const TestData& data, const TestData& ref_data, double tolerance)
+{
+    for(const auto& hist : ref_data.hist.GetHistograms())
+        CheckSameHistograms(*data.hist.GetHistograms().at(hist.first), *hist.second, tolerance);
+    for(const auto& hist : ref_data.emplaced.GetHistograms())
+        CheckSameHistograms(*data.emplaced.GetHistograms().at(hist.first), *hist.second, tolerance);
+}
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(sharded_fill_is_deterministic)
+{
+    TestData sharded, sharded_again, sequential;
+    FillSharded(sharded);
+    FillSharded(sharded_again);
+    FillSequential(sequential);
+    CheckSameData(sharded, sharded_again, 0);
+    CheckSameData(sharded, sequential, 1e-12);
+
+    const auto& custom = *sharded.emplaced.GetHistograms().at("custom");
+    BOOST_TEST(custom.GetNbinsX() == 7);
+    BOOST_TEST(custom.GetXaxis()->GetXmin() == 0.5);
+    BOOST_TEST(custom.GetXaxis()->GetXmax() == 2.5);
+}
+
+// Each thread dereferences its own copy of the handle, which caches the shard of the thread.
+BOOST_AUTO_TEST_CASE(handles_fill_the_shards_of_their_threads)
+{
+    TestData data, ref_data;
+    data.EnableSharding();
+    const auto handle = data.hist.GetHandle("handle");
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < NumberOfThreads; ++t) {
+        threads.emplace_back([&data, handle, t]() {
+            data.SetThreadShardIndex(t);
+            for(int n = static_cast<int>(t); n < NumberOfValues; n += static_cast<int>(NumberOfThreads))
+                handle->Fill(Value(n), Weight(n));
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+    data.MergeShards();
+    for(int n = 0; n < NumberOfValues; ++n)
+        ref_data.hist("handle").Fill(Value(n), Weight(n));
+    CheckSameData(data, ref_data, 1e-12);
+}
+
+// New histograms are added to AnalyzerData while the entries are merged from another thread.
+BOOST_AUTO_TEST_CASE(merge_while_adding_histograms)
+{
+    TestData data;
+    std::atomic<bool> done(false);
+    std::thread merger([&]() {
+        while(!done)
+            data.MergeShards();
+    });
+    for(int n = 0; n < 2000; ++n)
+        data.hist(n).Fill(Value(n));
+    done = true;
+    merger.join();
+    BOOST_TEST(data.hist.GetHistograms().size() == 2000u);
+}
@@ -24,11 +24,15 @@ struct MyAnaData : public root_ext::AnalyzerData {
 
 struct Arguments {
     REQ_ARG(std::string, output);
+    OPT_ARG(size_t, nWriteThreads, 1);
 };
 
 class AnalyzerData_t {
 public:
-    AnalyzerData_t(const Arguments& args) : output(root_ext::CreateRootFile(args.output())), anaData(output) {}
+    AnalyzerData_t(const Arguments& args) : output(root_ext::CreateRootFile(args.output())), anaData(output)
+    {
+        anaData.SetNumberOfWriteThreads(args.nWriteThreads());
+    }
 
     void Run()
     {
@@ -43,6 +47,11 @@ public:
         anaData.custom_hist().Fill(3.5);
         anaData.custom_hist(f).Fill(2.4);
         anaData.custom_hist(std::string("g")).Fill(1.5);
+        auto handle = anaData.custom_hist.GetHandle("h", 2);
+        handle->Fill(2.5);
+        anaData.custom_hist("batch").FillN({ 0.5, 1.5, 2.5, 4. }, { 1., 2., 1., 0.5 });
+        for(unsigned n = 0; n < 3; ++n)
+            anaData.hist(n, 1).Fill(n + 1.5);
     }
 
 private:
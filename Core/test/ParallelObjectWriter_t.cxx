@@ -0,0 +1,110 @@
+/*! Test ParallelObjectWriter.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include <random>
+#include <set>
+#include <TH2D.h>
+#include <TKey.h>
+#include <TMemFile.h>
+#include "AnalysisTools/Core/include/ParallelObjectWriter.h"
+
+#define BOOST_TEST_MODULE ParallelObjectWriter_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+namespace {
+using ObjectCollection = std::vector<std::unique_ptr<TObject>>;
+
+// Compressible and incompressible histograms, small objects that are stored without compression, a title that is
+// truncated by TKey and several objects with the same name.
+ObjectCollection CreateObjects()
+{
+    ObjectCollection objects;
+    std::mt19937 generator(12345);
+    std::normal_distribution<double> peak(0, 1);
+    for(int n = 0; n < 20; ++n) {
+        const std::string name = "hist_" + std::to_string(n % 15);
+        auto hist = std::make_unique<TH1D>(name.c_str(), name.c_str(), 100 * (n + 1), -5, 5);
+        hist->SetDirectory(nullptr);
+        for(int k = 0; k < 1000 * n; ++k)
+            hist->Fill(peak(generator));
+        objects.push_back(std::move(hist));
+    }
+    auto hist_2d = std::make_unique<TH2D>("hist_2d", std::string(40000, 't').c_str(), 50, -5, 5, 50, -5, 5);
+    hist_2d->SetDirectory(nullptr);
+    for(int k = 0; k < 10000; ++k)
+        hist_2d->Fill(peak(generator), peak(generator));
+    objects.push_back(std::move(hist_2d));
+    for(int n = 0; n < 5; ++n) {
+        const std::string name = "named_" + std::to_string(n);
+        objects.push_back(std::make_unique<TNamed>(name.c_str(), "small object"));
+    }
+    return objects;
+}
+
+std::unique_ptr<TMemFile> WriteObjects(const ObjectCollection& objects, size_t n_threads)
+{
+    auto file = std::make_unique<TMemFile>("ParallelObjectWriter_t.root", "RECREATE");
+    std::vector<const TObject*> object_ptrs;
+    for(const auto& object : objects)
+        object_ptrs.push_back(object.get());
+    root_ext::WriteObjectsParallel(*file, object_ptrs, n_threads);
+    return file;
+}
+
+void CheckSameObjects(TObject& object, TObject& ref_object)
+{
+    BOOST_TEST(std::string(object.ClassName()) == ref_object.ClassName());
+    BOOST_TEST(std::string(object.GetName()) == ref_object.GetName());
+    BOOST_TEST(std::string(object.GetTitle()) == ref_object.GetTitle());
+    auto hist = dynamic_cast<TH1*>(&object);
+    auto ref_hist = dynamic_cast<TH1*>(&ref_object);
+    BOOST_TEST(!hist == !ref_hist);
+    if(!hist || !ref_hist) return;
+    BOOST_TEST(hist->GetNcells() == ref_hist->GetNcells());
+    BOOST_TEST(hist->GetEntries() == ref_hist->GetEntries());
+    for(Int_t bin = 0; bin < std::min(hist->GetNcells(), ref_hist->GetNcells()); ++bin) {
+        BOOST_TEST(hist->GetBinContent(bin) == ref_hist->GetBinContent(bin));
+        BOOST_TEST(hist->GetBinError(bin) == ref_hist->GetBinError(bin));
+    }
+}
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(parallel_write_is_the_same_as_sequential)
+{
+    const auto objects = CreateObjects();
+    const auto ref_file = WriteObjects(objects, 1);
+    const auto file = WriteObjects(objects, 4);
+
+    TList* ref_keys = ref_file->GetListOfKeys();
+    TList* keys = file->GetListOfKeys();
+    BOOST_TEST(keys->GetSize() == ref_keys->GetSize());
+    for(TObject* ref_key_object : *ref_keys) {
+        auto ref_key = dynamic_cast<TKey*>(ref_key_object);
+        TKey* key = file->GetKey(ref_key->GetName(), ref_key->GetCycle());
+        BOOST_TEST_REQUIRE(key != nullptr, "key " << ref_key->GetName() << ";" << ref_key->GetCycle()
+                                                   << " is not found");
+        BOOST_TEST(key->GetCycle() == 1);
+        BOOST_TEST(std::string(key->GetClassName()) == ref_key->GetClassName());
+        BOOST_TEST(std::string(key->GetTitle()) == ref_key->GetTitle());
+        BOOST_TEST(key->GetKeylen() == ref_key->GetKeylen());
+        BOOST_TEST(key->GetObjlen() == ref_key->GetObjlen());
+        BOOST_TEST(key->GetNbytes() == ref_key->GetNbytes());
+
+        std::unique_ptr<TObject> object(key->ReadObj());
+        std::unique_ptr<TObject> ref_object(ref_key->ReadObj());
+        BOOST_TEST_REQUIRE(object.get() != nullptr);
+        BOOST_TEST_REQUIRE(ref_object.get() != nullptr);
+        CheckSameObjects(*object, *ref_object);
+    }
+
+    // Only the last object with the given name is kept in the file.
+    std::set<std::string> names;
+    for(auto iter = objects.rbegin(); iter != objects.rend(); ++iter) {
+        if(!names.insert((*iter)->GetName()).second) continue;
+        std::unique_ptr<TObject> object(file->Get((*iter)->GetName()));
+        BOOST_TEST_REQUIRE(object.get() != nullptr);
+        CheckSameObjects(*object, **iter);
+    }
+    BOOST_TEST(keys->GetSize() == static_cast<int>(names.size()));
+}
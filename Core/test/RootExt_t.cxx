@@ -0,0 +1,54 @@
+/*! Test the CERN ROOT extensions.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include <TH1D.h>
+#include <TStreamerInfo.h>
+#include "AnalysisTools/Core/include/RootExt.h"
+
+#define BOOST_TEST_MODULE RootExt_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+namespace {
+bool HasStreamerInfo(TFile& file, const std::string& class_name)
+{
+    std::unique_ptr<TList> infos(file.GetStreamerInfoList());
+    return infos && infos->FindObject(class_name.c_str()) != nullptr;
+}
+} // anonymous namespace
+
+// A histogram copied as a raw key is read back from the destination file, which contains its streamer info.
+BOOST_AUTO_TEST_CASE(raw_key_copy_round_trip)
+{
+    const std::string source_name = "RootExt_t_source.root", destination_name = "RootExt_t_destination.root";
+    TH1D ref_hist("hist", "raw copied histogram", 20, -2, 2);
+    ref_hist.SetDirectory(nullptr);
+    for(int n = 0; n < 1000; ++n)
+        ref_hist.Fill((n % 41) / 10. - 2, 1 + n % 3);
+    {
+        auto source = root_ext::CreateRootFile(source_name);
+        root_ext::WriteObject(ref_hist, source.get());
+    }
+    {
+        auto source = root_ext::OpenRootFile(source_name);
+        auto destination = root_ext::CreateRootFile(destination_name);
+        TDirectory* destination_dir = root_ext::GetDirectory(*destination, "dir");
+        root_ext::RawKeyCopier copier(*source);
+        TKey* key = source->GetKey("hist");
+        BOOST_TEST_REQUIRE(key != nullptr);
+        copier.Copy(*key, *destination_dir);
+        destination_dir->SaveSelf(kTRUE);
+    }
+
+    auto destination = root_ext::OpenRootFile(destination_name);
+    BOOST_TEST(HasStreamerInfo(*destination, "TH1D"));
+    BOOST_TEST(HasStreamerInfo(*destination, "TH1"));
+    std::unique_ptr<TH1D> hist(root_ext::ReadCloneObject<TH1D>(*destination, "dir/hist", "", true));
+    BOOST_TEST(std::string(hist->GetTitle()) == ref_hist.GetTitle());
+    BOOST_TEST_REQUIRE(hist->GetNcells() == ref_hist.GetNcells());
+    for(Int_t bin = 0; bin < ref_hist.GetNcells(); ++bin) {
+        BOOST_TEST(hist->GetBinContent(bin) == ref_hist.GetBinContent(bin));
+        BOOST_TEST(hist->GetBinError(bin) == ref_hist.GetBinError(bin));
+    }
+    BOOST_TEST(hist->GetEntries() == ref_hist.GetEntries());
+}
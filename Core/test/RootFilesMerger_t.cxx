@@ -0,0 +1,72 @@
+/*! Test RootFilesMerger.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include <TTree.h>
+#include "AnalysisTools/Core/include/RootFilesMerger.h"
+
+#define BOOST_TEST_MODULE RootFilesMerger_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+namespace {
+constexpr int NumberOfEntries = 100;
+
+// The first input has the compression of the merged file, so its baskets can be copied by the fast path, while
+// the second input has a different compression and is copied entry by entry.
+std::vector<std::string> CreateInputFiles()
+{
+    const std::vector<std::pair<ROOT::ECompressionAlgorithm, int>> compressions = {
+        { ROOT::kZLIB, 9 }, { ROOT::kLZMA, 1 }
+    };
+    std::vector<std::string> file_names;
+    for(size_t n = 0; n < compressions.size(); ++n) {
+        const std::string file_name = "RootFilesMerger_t_input_" + std::to_string(n) + ".root";
+        auto file = root_ext::CreateRootFile(file_name, compressions.at(n).first, compressions.at(n).second);
+        TTree tree("events", "events");
+        tree.SetDirectory(file.get());
+        Int_t id;
+        Double_t x;
+        tree.Branch("id", &id);
+        tree.Branch("x", &x);
+        for(int k = 0; k < NumberOfEntries; ++k) {
+            id = static_cast<Int_t>(n) * NumberOfEntries + k;
+            x = id / 7.;
+            tree.Fill();
+        }
+        root_ext::WriteObject(tree, file.get());
+        file_names.push_back(file_name);
+    }
+    return file_names;
+}
+
+void MergeAndCheck(const std::vector<std::string>& input_files, bool fast_tree_merge)
+{
+    const std::string output = fast_tree_merge ? "RootFilesMerger_t_fast.root" : "RootFilesMerger_t_slow.root";
+    {
+        analysis::RootFilesMerger merger(output, input_files, 1, ROOT::kZLIB, 9);
+        merger.SetFastTreeMerge(fast_tree_merge);
+        merger.Process(true, true);
+    }
+
+    auto file = root_ext::OpenRootFile(output);
+    std::unique_ptr<TTree> tree(root_ext::ReadObject<TTree>(*file, "events"));
+    const Long64_t n_expected = static_cast<Long64_t>(input_files.size()) * NumberOfEntries;
+    BOOST_TEST_REQUIRE(tree->GetEntries() == n_expected);
+    Int_t id;
+    Double_t x;
+    tree->SetBranchAddress("id", &id);
+    tree->SetBranchAddress("x", &x);
+    for(Long64_t entry = 0; entry < n_expected; ++entry) {
+        tree->GetEntry(entry);
+        BOOST_TEST(id == entry);
+        BOOST_TEST(x == id / 7.);
+    }
+}
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(fast_tree_merge_is_the_same_as_chain_merge)
+{
+    const auto input_files = CreateInputFiles();
+    MergeAndCheck(input_files, true);
+    MergeAndCheck(input_files, false);
+}
@@ -0,0 +1,224 @@
+/*! Test SmartHistogram class.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <random>
+#include "AnalysisTools/Core/include/SmartHistogram.h"
+
+#define BOOST_TEST_MODULE SmartHistogram_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+using Hist = root_ext::SmartHistogram<TH1D>;
+
+namespace {
+analysis::PropertyConfigReader::Item AutoBinningConfig(size_t max_buffered)
+{
+    analysis::PropertyConfigReader::Item item;
+    item.name = "auto";
+    item["auto_binning"] = "true";
+    item["n_bins"] = "100";
+    item["auto_binning_buffer"] = std::to_string(max_buffered);
+    return item;
+}
+
+std::vector<double> GenerateMassPeak(size_t n_values)
+{
+    std::mt19937 generator(12345);
+    std::normal_distribution<double> peak(91.2, 2.5);
+    std::vector<double> values(n_values);
+    for(auto& value : values)
+        value = peak(generator);
+    return values;
+}
+
+// All bin edges, the closest values around them, NaN and random values that are inside and outside of the axis range.
+std::vector<double> GenerateAxisValues(const std::vector<double>& edges, size_t n_random, unsigned seed)
+{
+    std::vector<double> values;
+    for(double edge : edges) {
+        values.push_back(edge);
+        values.push_back(std::nextafter(edge, -std::numeric_limits<double>::infinity()));
+        values.push_back(std::nextafter(edge, std::numeric_limits<double>::infinity()));
+    }
+    values.push_back(std::numeric_limits<double>::quiet_NaN());
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<double> uniform(edges.front() - 0.5, edges.back() + 0.5);
+    while(values.size() < n_random)
+        values.push_back(uniform(generator));
+    std::shuffle(values.begin(), values.end(), generator);
+    return values;
+}
+
+std::vector<double> UniformEdges(int n_bins, double low, double high)
+{
+    std::vector<double> edges;
+    TAxis axis(n_bins, low, high);
+    for(Int_t bin = 1; bin <= n_bins + 1; ++bin)
+        edges.push_back(axis.GetBinLowEdge(bin));
+    return edges;
+}
+
+std::vector<double> GenerateWeights(size_t n_values)
+{
+    std::vector<double> weights(n_values);
+    for(size_t n = 0; n < n_values; ++n)
+        weights[n] = 0.5 + n % 3;
+    return weights;
+}
+
+void CheckSameHistograms(const TH1& hist, const TH1& ref_hist)
+{
+    BOOST_TEST_REQUIRE(hist.GetNcells() == ref_hist.GetNcells());
+    for(Int_t bin = 0; bin < ref_hist.GetNcells(); ++bin) {
+        BOOST_TEST(hist.GetBinContent(bin) == ref_hist.GetBinContent(bin));
+        BOOST_TEST(hist.GetBinError(bin) == ref_hist.GetBinError(bin));
+    }
+    BOOST_TEST(hist.GetEntries() == ref_hist.GetEntries());
+    std::array<double, 13> stats{}, ref_stats{};
+    hist.GetStats(stats.data());
+    ref_hist.GetStats(ref_stats.data());
+    BOOST_TEST(stats == ref_stats, boost::test_tools::per_element());
+}
+
+void CheckFillN1D(Hist&& hist, const std::vector<double>& edges, bool use_weights)
+{
+    const auto values = GenerateAxisValues(edges, 5000, 42);
+    const auto weights = GenerateWeights(values.size());
+    TH1D ref_hist(hist);
+    ref_hist.SetDirectory(nullptr);
+    hist.FillN(static_cast<Int_t>(values.size()), values.data(), use_weights ? weights.data() : nullptr);
+    for(size_t n = 0; n < values.size(); ++n) {
+        if(use_weights)
+            ref_hist.Fill(values[n], weights[n]);
+        else
+            ref_hist.Fill(values[n]);
+    }
+    CheckSameHistograms(hist, ref_hist);
+}
+
+void CheckFillN2D(root_ext::SmartHistogram<TH2D>&& hist, const std::vector<double>& x_edges,
+                  const std::vector<double>& y_edges, bool use_weights)
+{
+    const auto x_values = GenerateAxisValues(x_edges, 5000, 42);
+    const auto y_values = GenerateAxisValues(y_edges, x_values.size(), 43);
+    BOOST_TEST_REQUIRE(x_values.size() == y_values.size());
+    const auto weights = GenerateWeights(x_values.size());
+    TH2D ref_hist(hist);
+    ref_hist.SetDirectory(nullptr);
+    hist.FillN(static_cast<Int_t>(x_values.size()), x_values.data(), y_values.data(),
+               use_weights ? weights.data() : nullptr);
+    for(size_t n = 0; n < x_values.size(); ++n) {
+        if(use_weights)
+            ref_hist.Fill(x_values[n], y_values[n], weights[n]);
+        else
+            ref_hist.Fill(x_values[n], y_values[n]);
+    }
+    CheckSameHistograms(hist, ref_hist);
+}
+} // anonymous namespace
+
+// Without the binning and without auto_binning, the range is chosen by the TH1 buffer.
+BOOST_AUTO_TEST_CASE(auto_binning_is_opt_in)
+{
+    analysis::PropertyConfigReader::Item item;
+    item.name = "default";
+    Hist hist("default", item);
+    BOOST_TEST(!hist.HasAutoBinning());
+    const auto values = GenerateMassPeak(100);
+    for(double value : values)
+        hist.Fill(value);
+    hist.BufferEmpty();
+    BOOST_TEST(hist.GetEntries() == static_cast<double>(values.size()));
+    BOOST_TEST(hist.Integral() == static_cast<double>(values.size()));
+    BOOST_TEST(hist.GetXaxis()->GetXmin() <= *std::min_element(values.begin(), values.end()));
+    BOOST_TEST(hist.GetXaxis()->GetXmax() > *std::max_element(values.begin(), values.end()));
+}
+
+BOOST_AUTO_TEST_CASE(auto_binning_is_exact_while_values_are_buffered)
+{
+    const auto values = GenerateMassPeak(10000);
+    Hist hist("auto", AutoBinningConfig(100000)), shard("auto_shard", AutoBinningConfig(100000));
+    for(size_t n = 0; n < values.size(); ++n) {
+        Hist& target = n % 2 ? shard : hist;
+        BOOST_TEST(target.Fill(values[n], 0.5 + n % 3) == -1);
+    }
+    BOOST_TEST(hist.Integral() == 0.);
+    hist.AddShard(shard);
+    BOOST_TEST(hist.IsAutoBinningExact());
+    hist.ApplyAutoBinning();
+    BOOST_TEST(!hist.HasAutoBinning());
+    BOOST_TEST(hist.GetNbinsX() == 100);
+
+    TH1D direct("direct", "direct", hist.GetNbinsX(), hist.GetXaxis()->GetXmin(), hist.GetXaxis()->GetXmax());
+    direct.SetDirectory(nullptr);
+    for(size_t n = 0; n < values.size(); n += 2)
+        direct.Fill(values[n], 0.5 + n % 3);
+    for(size_t n = 1; n < values.size(); n += 2)
+        direct.Fill(values[n], 0.5 + n % 3);
+    for(Int_t bin = 0; bin <= direct.GetNbinsX() + 1; ++bin) {
+        BOOST_TEST(hist.GetBinContent(bin) == direct.GetBinContent(bin));
+        BOOST_TEST(hist.GetBinError(bin) == direct.GetBinError(bin));
+    }
+    BOOST_TEST(hist.GetEntries() == direct.GetEntries());
+    BOOST_TEST(hist.GetMean() == direct.GetMean(), boost::test_tools::tolerance(1e-12));
+}
+
+BOOST_AUTO_TEST_CASE(auto_binning_approximation_has_no_spikes)
+{
+    const auto values = GenerateMassPeak(100000);
+    Hist hist("auto", AutoBinningConfig(1000));
+    for(double value : values)
+        hist.Fill(value);
+    BOOST_TEST(!hist.IsAutoBinningExact());
+    hist.ApplyAutoBinning();
+
+    const double max_abs_value = std::max(std::abs(hist.GetXaxis()->GetXmin()),
+                                          std::abs(hist.GetXaxis()->GetXmax()));
+    const double bucket_width = max_abs_value / std::ldexp(1., analysis::QuantileSketch::DefaultPrecisionBits);
+    BOOST_TEST(hist.GetNbinsX() <= 100);
+    BOOST_TEST(hist.GetXaxis()->GetBinWidth(1) >= bucket_width);
+    BOOST_TEST(hist.Integral(0, hist.GetNbinsX() + 1) == double(values.size()), boost::test_tools::tolerance(1e-9));
+
+    TH1D direct("direct", "direct", hist.GetNbinsX(), hist.GetXaxis()->GetXmin(), hist.GetXaxis()->GetXmax());
+    direct.SetDirectory(nullptr);
+    for(double value : values)
+        direct.Fill(value);
+    for(Int_t bin = 1; bin <= direct.GetNbinsX(); ++bin) {
+        const double expected = direct.GetBinContent(bin);
+        BOOST_TEST(std::abs(hist.GetBinContent(bin) - expected) <= 0.1 * expected + 5 * std::sqrt(expected) + 5);
+    }
+    BOOST_TEST(hist.GetMean() == direct.GetMean(), boost::test_tools::tolerance(1e-3));
+}
+
+BOOST_AUTO_TEST_CASE(fill_n_is_the_same_as_fill)
+{
+    const std::vector<double> variable_edges = { -1, 0.1, 0.35, 1, 2.5 }, variable_y_edges = { 0, 0.3, 0.7, 5 };
+    for(bool use_weights : { false, true }) {
+        CheckFillN1D(Hist("uniform", 10, 0.1, 1.3), UniformEdges(10, 0.1, 1.3), use_weights);
+        CheckFillN1D(Hist("variable", variable_edges), variable_edges, use_weights);
+        CheckFillN2D(root_ext::SmartHistogram<TH2D>("uniform_2d", 7, -0.3, 1.1, 9, 0.2, 2.9),
+                     UniformEdges(7, -0.3, 1.1), UniformEdges(9, 0.2, 2.9), use_weights);
+        CheckFillN2D(root_ext::SmartHistogram<TH2D>("variable_2d", variable_edges, variable_y_edges),
+                     variable_edges, variable_y_edges, use_weights);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(fill_n_vector_counts_upper_edge_in_last_bin)
+{
+    Hist uniform("uniform", 10, 0.1, 1.3), variable("variable", std::vector<double>{ 0, 0.1, 0.35, 1.3 });
+    for(Hist* hist : { &uniform, &variable }) {
+        const Int_t n_bins = hist->GetNbinsX();
+        const double low = hist->GetXaxis()->GetXmin(), high = hist->GetXaxis()->GetXmax();
+        hist->FillN(std::vector<double>{ low - 1, low, high, high + 1, std::numeric_limits<double>::quiet_NaN() });
+        BOOST_TEST(hist->GetBinContent(0) == 1.);
+        BOOST_TEST(hist->GetBinContent(1) == 1.);
+        BOOST_TEST(hist->GetBinContent(n_bins) == 1.);
+        BOOST_TEST(hist->GetBinContent(n_bins + 1) == 2.);
+        hist->FillN(1, &high, nullptr);
+        BOOST_TEST(hist->GetBinContent(n_bins) == 1.);
+        BOOST_TEST(hist->GetBinContent(n_bins + 1) == 3.);
+    }
+}
@@ -0,0 +1,225 @@
+/*! Test SmartTree class.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include <cstdio>
+#include <fstream>
+#include <TMemFile.h>
+#include "AnalysisTools/Core/include/SmartTree.h"
+#include "AnalysisTools/Core/include/SmartTreeParallel.h"
+
+#define BOOST_TEST_MODULE SmartTree_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#define TEST_DATA() \
+    VAR(Int_t, id) \
+    VAR(double, x) \
+    /**/
+
+#define VAR(type, name) DECLARE_BRANCH_VARIABLE(type, name)
+DECLARE_TREE(test, TestData, TestTree, TEST_DATA, "test_tree")
+#undef VAR
+
+#define VAR(type, name) ADD_DATA_TREE_BRANCH(name)
+INITIALIZE_TREE(test, TestTree, TEST_DATA)
+#undef VAR
+
+#define DERIVED_DATA() \
+    TEST_DATA() \
+    VAR(double, y) \
+    /**/
+
+#define VAR(type, name) DECLARE_BRANCH_VARIABLE(type, name)
+DECLARE_TREE(test, DerivedData, DerivedTree, DERIVED_DATA, "test_tree")
+#undef VAR
+
+#define VAR(type, name) ADD_DATA_TREE_BRANCH(name)
+INITIALIZE_TREE(test, DerivedTree, DERIVED_DATA)
+#undef VAR
+#undef DERIVED_DATA
+#undef TEST_DATA
+
+namespace {
+constexpr Long64_t NumberOfEntries = 10000;
+
+// Small baskets, so that the tree has many baskets and the ranges below start and end inside of them.
+void WriteTestTree(TDirectory& dir)
+{
+    root_ext::SmartTreeWriteProfile profile;
+    profile.default_basket_size = 1024;
+    test::TestTree tree(&dir, profile);
+    for(Long64_t n = 0; n < NumberOfEntries; ++n) {
+        tree().id = static_cast<Int_t>(n);
+        tree().x = n * 0.5 - 17;
+        tree.Fill();
+    }
+    tree.Write();
+}
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(bulk_read_from_the_middle_of_a_basket)
+{
+    TMemFile file("SmartTree_t.root", "RECREATE");
+    WriteTestTree(file);
+    test::TestTree tree(&file, true);
+    BOOST_TEST(tree.GetEntries() == NumberOfEntries);
+
+    auto block = tree.CreateBulkBlock({ "id", "x" });
+    for(Long64_t first_entry : { Long64_t(0), Long64_t(1), Long64_t(1234), Long64_t(9999) }) {
+        for(Long64_t first = first_entry; first < NumberOfEntries;) {
+            const Long64_t n_read = tree.ReadBulk(first, 777, block);
+            BOOST_TEST(n_read == std::min<Long64_t>(777, NumberOfEntries - first));
+            const auto& ids = block.Get<Int_t>("id");
+            const auto& xs = block.Get<double>("x");
+            BOOST_TEST(ids.size() == static_cast<size_t>(n_read));
+            BOOST_TEST(xs.size() == static_cast<size_t>(n_read));
+            for(Long64_t n = 0; n < n_read; n += 97) {
+                tree.GetEntry(first + n);
+                BOOST_TEST(ids[static_cast<size_t>(n)] == GET_TREE_BRANCH(tree, id));
+                BOOST_TEST(xs[static_cast<size_t>(n)] == GET_TREE_BRANCH(tree, x));
+            }
+            first += n_read;
+        }
+    }
+    BOOST_TEST(tree.ReadBulk(NumberOfEntries, 10, block) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(access_tracking_is_incomplete_after_direct_access)
+{
+    TMemFile file("SmartTree_t.root", "RECREATE");
+    WriteTestTree(file);
+    root_ext::SmartTreeReadOptions options;
+    options.track_access = true;
+    test::TestTree tree(&file, options);
+    tree.GetEntry(10);
+    BOOST_TEST(GET_TREE_BRANCH(tree, x) == 10 * 0.5 - 17);
+    BOOST_TEST(tree.IsAccessTrackingComplete());
+    BOOST_TEST((tree.GetAccessedBranches() == std::set<std::string>{ "x" }));
+    BOOST_TEST(tree().id == 10);
+    BOOST_TEST(!tree.IsAccessTrackingComplete());
+}
+
+// The code that reads the branches only through the accessors gets the whitelist of the accessed branches.
+BOOST_AUTO_TEST_CASE(access_whitelist_is_written_for_accessors)
+{
+    const std::string whitelist = "SmartTree_t_whitelist.txt";
+    TMemFile file("SmartTree_t.root", "RECREATE");
+    WriteTestTree(file);
+    root_ext::SmartTreeReadOptions options;
+    options.track_access = true;
+    options.access_whitelist = whitelist;
+    {
+        test::TestTree tree(&file, options);
+        double sum = 0;
+        for(Long64_t n = 0; n < tree.GetEntries(); ++n) {
+            tree.GetEntry(n);
+            sum += GET_TREE_BRANCH(tree, x);
+        }
+        BOOST_TEST(sum == NumberOfEntries * (NumberOfEntries - 1) / 4. - 17 * NumberOfEntries);
+    }
+    BOOST_TEST((root_ext::SmartTree::LoadBranchList(whitelist) == std::set<std::string>{ "x" }));
+    std::remove(whitelist.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(explicit_basket_size_is_kept_after_first_cluster)
+{
+    for(bool optimize_baskets : { false, true }) {
+        TMemFile file("SmartTree_t.root", "RECREATE");
+        root_ext::SmartTreeWriteProfile profile;
+        profile.auto_flush = -1024;
+        profile.optimize_baskets = optimize_baskets;
+        profile.SetBasketSize("x", 16000);
+        {
+            test::TestTree tree(&file, profile);
+            for(Long64_t n = 0; n < NumberOfEntries; ++n) {
+                tree().id = static_cast<Int_t>(n);
+                tree().x = n * 0.5 - 17;
+                tree.Fill();
+            }
+            tree.Write();
+        }
+        auto tree = dynamic_cast<TTree*>(file.Get("test_tree"));
+        BOOST_TEST_REQUIRE(tree != nullptr);
+        BOOST_TEST(tree->GetAutoFlush() > 0);
+        BOOST_TEST(tree->GetAutoFlush() < NumberOfEntries);
+        BOOST_TEST(tree->GetBranch("x")->GetBasketSize() == 16000);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(misaligned_derived_tree_is_not_overwritten)
+{
+    TMemFile file("SmartTree_t.root", "RECREATE");
+    WriteTestTree(file);
+    {
+        TTree misaligned("test_tree_derived0", "test_tree_derived0");
+        double y = 0;
+        misaligned.Branch("y", &y);
+        for(int n = 0; n < 5; ++n)
+            misaligned.Fill();
+        file.WriteTObject(&misaligned);
+    }
+
+    root_ext::SmartTreeReadOptions options;
+    options.derived_columns = true;
+    {
+        test::DerivedTree tree(&file, options);
+        BOOST_TEST((tree.GetDerivedBranches() == std::set<std::string>{ "y" }));
+        for(Long64_t n = 0; n < NumberOfEntries; ++n) {
+            tree.GetEntry(n);
+            tree().y = tree().x * 2;
+            tree.FillDerived();
+        }
+        tree.Write();
+    }
+
+    auto misaligned = dynamic_cast<TTree*>(file.Get("test_tree_derived0"));
+    BOOST_TEST_REQUIRE(misaligned != nullptr);
+    BOOST_TEST(misaligned->GetEntries() == 5);
+    auto derived = dynamic_cast<TTree*>(file.Get("test_tree_derived1"));
+    BOOST_TEST_REQUIRE(derived != nullptr);
+    BOOST_TEST(derived->GetEntries() == NumberOfEntries);
+
+    test::DerivedTree tree(&file, true);
+    tree.GetEntry(10);
+    BOOST_TEST(GET_TREE_BRANCH(tree, y) == 2 * (10 * 0.5 - 17));
+}
+
+BOOST_AUTO_TEST_CASE(parallel_for_each_counts_init_once)
+{
+    const std::string file_name = "SmartTree_t_parallel.root";
+    {
+        auto file = root_ext::CreateRootFile(file_name);
+        WriteTestTree(*file);
+    }
+    auto file = root_ext::OpenRootFile(file_name);
+    test::TestTree tree(file.get(), true);
+    const Long64_t init = 1000000000;
+    const auto sum = root_ext::ParallelForEach(tree, root_ext::EntryRange{ 0, NumberOfEntries }, 4,
+        [](const test::TestData& data, Long64_t& total) { total += data.id; }, init,
+        [](Long64_t& total, const Long64_t& other) { total += other; });
+    BOOST_TEST(sum == init + NumberOfEntries * (NumberOfEntries - 1) / 2);
+    std::remove(file_name.c_str());
+}
+
+// Each worker reads with the options of the source tree and writes its own profile report.
+BOOST_AUTO_TEST_CASE(parallel_for_each_uses_read_options)
+{
+    const std::string file_name = "SmartTree_t_parallel_options.root", report = "SmartTree_t_parallel_profile.txt";
+    {
+        auto file = root_ext::CreateRootFile(file_name);
+        WriteTestTree(*file);
+    }
+    root_ext::SmartTreeReadOptions read_options;
+    read_options.profile_read = true;
+    read_options.profile_report = report;
+    {
+        auto file = root_ext::OpenRootFile(file_name);
+        test::TestTree tree(file.get(), read_options);
+        root_ext::ParallelForEach(tree, root_ext::EntryRange{ 0, NumberOfEntries }, 2, [](const test::TestData&) {});
+    }
+    const std::string worker_report = report + ".0";
+    BOOST_TEST(std::ifstream(worker_report).good(), "report " << worker_report << " is not written");
+    std::remove(worker_report.c_str());
+    std::remove(report.c_str());
+    std::remove(file_name.c_str());
+}
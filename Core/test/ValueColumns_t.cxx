@@ -0,0 +1,106 @@
+/*! Test ValueColumns class.
+This file is part of https://github.com/hh-italian-group/AnalysisTools. */
+
+#include <thread>
+#include "AnalysisTools/Core/include/ValueColumns.h"
+
+#define BOOST_TEST_MODULE ValueColumns_t
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+using Columns = root_ext::detail::ValueColumns<int, 2>;
+
+namespace {
+// Restores the default memory limit at the end of the test.
+struct MemoryLimitGuard {
+    const size_t original_limit{Columns::GetMemoryLimit()};
+    explicit MemoryLimitGuard(size_t limit) { Columns::SetMemoryLimit(limit); }
+    ~MemoryLimitGuard() { Columns::SetMemoryLimit(original_limit); }
+};
+
+// Each thread appends (thread_id, n) pairs with n = 0, 1, ... The values of each thread should be read back
+// in the same order.
+void CheckContent(const Columns& columns, int n_threads, int n_per_thread)
+{
+    std::vector<int> last(static_cast<size_t>(n_threads), -1);
+    size_t n_total = 0;
+    bool ordered = true;
+    columns.ForEachBlock([&](const Columns::ColumnPointers& column, size_t n_values) {
+        for(size_t n = 0; n < n_values; ++n) {
+            int& last_value = last.at(static_cast<size_t>(column[0][n]));
+            ordered = ordered && column[1][n] == last_value + 1;
+            last_value = column[1][n];
+        }
+        n_total += n_values;
+    });
+    BOOST_TEST(ordered);
+    BOOST_TEST(n_total == static_cast<size_t>(n_threads * n_per_thread));
+    for(int value : last)
+        BOOST_TEST(value == n_per_thread - 1);
+}
+
+void FillFromThreads(Columns& columns, int n_threads, int n_per_thread)
+{
+    std::vector<std::thread> threads;
+    for(int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&columns, t, n_per_thread]() {
+            for(int n = 0; n < n_per_thread; ++n)
+                columns.Append({{ t, n }});
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+}
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(small_columns_take_little_memory)
+{
+    const size_t usage_before = Columns::GetMemoryUsage();
+    {
+        Columns columns;
+        columns.Append({{ 1, 2 }});
+        BOOST_TEST(Columns::GetMemoryUsage() - usage_before == 2 * Columns::MinBlockSize * sizeof(int));
+        BOOST_TEST(columns.size() == 1u);
+    }
+    BOOST_TEST(Columns::GetMemoryUsage() == usage_before);
+}
+
+BOOST_AUTO_TEST_CASE(multithreaded_append)
+{
+    Columns columns;
+    FillFromThreads(columns, 4, 100000);
+    BOOST_TEST(columns.size() == 400000u);
+    CheckContent(columns, 4, 100000);
+    const Columns copy(columns);
+    CheckContent(copy, 4, 100000);
+}
+
+BOOST_AUTO_TEST_CASE(spill_to_file)
+{
+    const size_t usage_before = Columns::GetMemoryUsage();
+    MemoryLimitGuard guard(usage_before + 64 * 1024);
+    Columns columns;
+    FillFromThreads(columns, 4, 300000);
+    BOOST_TEST(columns.size() == 1200000u);
+    BOOST_TEST(Columns::GetMemoryUsage() <= usage_before + 64 * 1024 + 4 * Columns::MinBlockSize * 2 * sizeof(int));
+    CheckContent(columns, 4, 300000);
+    columns.Clear();
+    BOOST_TEST(columns.size() == 0u);
+    BOOST_TEST(Columns::GetMemoryUsage() == usage_before);
+}
+
+// The thread-local lane pointers of the destroyed columns are dropped while new columns are created.
+BOOST_AUTO_TEST_CASE(short_lived_columns)
+{
+    for(int n = 0; n < 1000; ++n) {
+        Columns columns;
+        columns.Append({{ 0, n }});
+        columns.Append({{ 0, n + 1 }});
+        BOOST_TEST_REQUIRE(columns.size() == 2u);
+        columns.ForEachBlock([&](const Columns::ColumnPointers& column, size_t n_values) {
+            BOOST_TEST(n_values == 2u);
+            BOOST_TEST(column[1][0] == n);
+            BOOST_TEST(column[1][1] == n + 1);
+        });
+    }
+}